@@ -0,0 +1,27 @@
+#include "alloc-stats.h"
+#include <stdlib.h>
+#include <new>
+
+//linked only into leveldbd, the tools keep the default operator new
+void* operator new(size_t sz) {
+    AllocStats::Shard& s = AllocStats::local();
+    s.allocs.fetch_add(1, memory_order_relaxed);
+    s.bytes.fetch_add(sz, memory_order_relaxed);
+    void* p = malloc(sz ? sz : 1);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t sz) {
+    return operator new(sz);
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
@@ -0,0 +1,41 @@
+#include "alloc-stats.h"
+
+//zero initialized before any allocation, so it is usable from operator new during static init
+static AllocStats g_alloc;
+static atomic<int> g_nextShard(0);
+static thread_local int t_shard = -1;
+
+AllocStats& AllocStats::instance() {
+    return g_alloc;
+}
+
+AllocStats::Shard& AllocStats::local() {
+    if (t_shard < 0) {
+        t_shard = g_nextShard.fetch_add(1, memory_order_relaxed) % SHARDS;
+    }
+    return g_alloc.shards_[t_shard];
+}
+
+int64_t AllocStats::allocs() {
+    int64_t n = 0;
+    for (auto& s: shards_) {
+        n += s.allocs.load(memory_order_relaxed);
+    }
+    return n;
+}
+
+int64_t AllocStats::bytes() {
+    int64_t n = 0;
+    for (auto& s: shards_) {
+        n += s.bytes.load(memory_order_relaxed);
+    }
+    return n;
+}
+
+int64_t AllocStats::requests() {
+    int64_t n = 0;
+    for (auto& s: shards_) {
+        n += s.requests.load(memory_order_relaxed);
+    }
+    return n;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <atomic>
+#include <stdint.h>
+
+using namespace std;
+
+//heap allocations counted in the operator new of alloc-new.cc, linked only into leveldbd, and http requests served, for allocations per request.
+//counters are sharded by thread so the read threads do not share a cache line on every malloc
+struct AllocStats {
+    enum { SHARDS = 32 };
+    struct alignas(64) Shard {
+        atomic<int64_t> allocs, bytes, requests;
+    };
+    Shard shards_[SHARDS];
+    static AllocStats& instance();
+    static Shard& local();
+    void addRequest() { local().requests.fetch_add(1, memory_order_relaxed); }
+    int64_t allocs();
+    int64_t bytes();
+    int64_t requests();
+};
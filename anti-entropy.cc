@@ -0,0 +1,269 @@
+#include "anti-entropy.h"
+#include "handler.h"
+#include "async-log.h"
+#include "binlog-msg.h"
+#include <memory>
+
+bool AntiEntropy::start(size_t idx, bool repair) {
+    if (running_ || idx >= db_->slaves_.size()) {
+        return false;
+    }
+    if (g_sync_filter.size()) { //hashes of master cover all keys
+        warn("anti-entropy is not supported with sync_filter");
+        return false;
+    }
+    running_ = true;
+    checked_ = differ_ = repaired_ = 0;
+    idx_ = idx;
+    repair_ = repair;
+    todo_.push_back(make_pair(string(), string()));
+    int64_t gen = ++gen_;
+    SlaveStatus ss = db_->getSlaveStatusLock(idx);
+    info("anti-entropy with master %s:%d started, repair %d", ss.host.c_str(), ss.port, repair);
+    con_ = TcpConn::createConnection(base_, ss.host, ss.port, 3000);
+    con_->onState([this, gen](const TcpConnPtr& con) {
+        TcpConn::State st = con->getState();
+        if (gen != gen_) {
+            return;
+        } else if (st == TcpConn::Connected) {
+            sendNext_();
+        } else if (st == TcpConn::Failed || st == TcpConn::Closed) {
+            finish_("connection to master closed");
+        }
+    });
+    HttpConnPtr(con_).onHttpMsg([this, gen](const HttpConnPtr& hcon) {
+        if (gen == gen_) {
+            onResp_();
+        }
+    });
+    return true;
+}
+
+void AntiEntropy::sendNext_() {
+    HttpConnPtr con(con_);
+    HttpRequest& req = con.getRequest();
+    if (repairs_.size() && !held_) { //binlog of the channel waits while a page is read and applied
+        held_ = true;
+        int64_t gen = gen_;
+        size_t idx = idx_;
+        wpool_->addTask([=] {
+            db_->holdSync(idx, true);
+            base_->safeCall([=] {
+                if (gen == gen_) {
+                    sendNext_();
+                }
+            });
+        });
+        return;
+    } else if (repairs_.size()) {
+        hashing_ = false;
+        if (repairInc_) {
+            repairFrom_ = repairs_.front().first;
+        }
+        req.headers["req-info"] = "0 0 1"; //stored values with versions and deleted marks, as in full sync
+        req.query_uri = "/range-get/" + repairFrom_ + "?end=" + repairs_.front().second + (repairInc_ ? "&inc=1" : "");
+    } else if (todo_.size()) {
+        hashing_ = true;
+        req.query_uri = "/range-hash/" + todo_.front().first + "?end=" + todo_.front().second + "&parts=16";
+    } else {
+        finish_(NULL);
+        return;
+    }
+    adebug("anti-entropy geting %s", req.query_uri.c_str());
+    con.sendRequest();
+}
+
+//write the keys of a master page and delete local keys missing in it.
+//the page covers (from, last key of page], or (from, end) if it is empty.
+//it holds the master binlog before pos, EAGAIN if the channel has applied more, local keys may be newer than the page
+static Status applyRepair(LogDb* db, size_t idx, const RepairPage& pg, Slice body, string* last, int64_t* n) {
+    SlaveStatus ss = db->getSlaveStatusLock(idx);
+    if (!ss.pos.dataFinished) {
+        return Status(EINVAL, "full sync of the channel is not finished");
+    } else if (ss.pos.fileno > pg.fileno || (ss.pos.fileno == pg.fileno && ss.pos.offset > pg.offset)) {
+        return Status(EAGAIN, "channel is ahead of the page");
+    }
+    vector<pair<Slice, Slice>> kvs;
+    Slice key, value;
+    bool exist;
+    Status st;
+    while (body.size() && (st=decodeKvBody(&body, &key, &value, &exist), st.ok())) {
+        kvs.push_back(make_pair(key, value));
+    }
+    if (!st.ok()) {
+        return st;
+    }
+    *last = kvs.size() ? kvs.back().first.toString() : string();
+    vector<LogRecord> recs;
+    deque<string> keys, values; //local keys deleted and values given versions, referenced by recs
+    time_t now = time(NULL);
+    unique_ptr<leveldb::Iterator> it(db->getdb()->NewIterator(leveldb::ReadOptions()));
+    it->Seek(pg.from);
+    if (!pg.inc && it->Valid() && it->key() == pg.from) {
+        it->Next();
+    }
+    size_t i = 0;
+    for (; it->Valid(); it->Next()) {
+        Slice k = convSlice(it->key());
+        if (kvs.size() ? k.compare(*last) > 0 : k.compare(pg.end) >= 0) {
+            break;
+        }
+        while (i < kvs.size() && kvs[i].first.compare(k) < 0) {
+            i ++;
+        }
+        ValueMeta meta;
+        Slice v;
+        if ((i < kvs.size() && kvs[i].first == k) || !ValueMeta::decode(convSlice(it->value()), &meta, &v) || meta.expired(now)) {
+            continue;
+        }
+        keys.push_back(k);
+        string mark;
+        if (db->versioned_) {
+            if (meta.dbid == db->dbid_) { //written here and not pulled by master yet
+                keys.pop_back();
+                continue;
+            }
+            //deleted with the version of the local value, a newer write is not lost
+            values.push_back(string());
+            ValueMeta(meta.ts, meta.dbid, true).encode("", &values.back());
+            mark = values.back();
+        }
+        recs.push_back(LogRecord(pg.masterDbid, now, keys.back(), mark, BinlogDelete));
+    }
+    it.reset();
+    for (auto& kv: kvs) {
+        recs.push_back(copiedRecord(db, pg.masterDbid, kv.first, kv.second, &values));
+    }
+    *n = recs.size();
+    return recs.size() ? db->applyLogs(recs, true) : Status();
+}
+
+void AntiEntropy::onResp_() {
+    HttpConnPtr con(con_);
+    HttpResponse& res = con.getResponse();
+    if (res.status != 200) {
+        error("anti-entropy response error. code %d", res.status);
+        finish_("master error");
+        return;
+    }
+    shared_ptr<RepairPage> pg;
+    if (!hashing_) { //read before clearData
+        vector<Slice> pos = Slice(res.getHeader("binlog-pos")).split(' ');
+        if (pos.size() != 3) {
+            finish_("no binlog-pos from master, binlog of master is needed for repair");
+            return;
+        }
+        pg.reset(new RepairPage);
+        pg->masterDbid = util::atoi(pos[0].data());
+        pg->fileno = util::atoi(pos[1].data());
+        pg->offset = util::atoi(pos[2].data());
+        pg->from = repairFrom_;
+        pg->end = repairs_.front().second;
+        pg->inc = repairInc_;
+    }
+    shared_ptr<string> body(new string);
+    if (res.body2.size()) {
+        body->assign(res.body2.data(), res.body2.size());
+    } else {
+        body->swap(res.body);
+    }
+    con.clearData();
+    int64_t gen = gen_;
+    if (hashing_) {
+        pool_.addTask([=] {
+            vector<RangeHash> ranges;
+            shared_ptr<vector<RangeHash>> diffs(new vector<RangeHash>);
+            Status st = decodeRangeHashes(*body, &ranges);
+            for (size_t i = 0; st.ok() && i < ranges.size(); i ++) {
+                vector<RangeHash> local;
+                st = hashRange(db_, ranges[i].begin, ranges[i].end, 1, &local);
+                if (st.ok() && (local[0].hash != ranges[i].hash || local[0].count != ranges[i].count)) {
+                    diffs->push_back(ranges[i]);
+                }
+            }
+            size_t n = ranges.size();
+            string err = st.ok() ? "" : st.toString();
+            base_->safeCall([=] {
+                if (gen != gen_) {
+                    return;
+                } else if (err.size()) {
+                    error("anti-entropy hash failed %s", err.c_str());
+                    finish_("hash failed");
+                    return;
+                }
+                checked_ += n;
+                todo_.pop_front();
+                for (auto& r: *diffs) {
+                    if (!r.leaf) {
+                        todo_.push_back(make_pair(r.begin, r.end));
+                        continue;
+                    }
+                    differ_ ++;
+                    warn("range [%s, %s) differs from master with %ld keys %ld bytes",
+                        r.begin.c_str(), r.end.c_str(), (long)r.count, (long)r.bytes);
+                    if (repair_) {
+                        repairs_.push_back(make_pair(r.begin, r.end));
+                    }
+                }
+                sendNext_();
+            });
+        });
+    } else {
+        size_t idx = idx_;
+        wpool_->addTask([=] {
+            string last;
+            int64_t n = 0;
+            Status st = applyRepair(db_, idx, *pg, *body, &last, &n);
+            bool again = st.code() == EAGAIN;
+            if (!again) {
+                db_->holdSync(idx, false);
+            }
+            string err = st.ok() || again ? "" : st.toString();
+            base_->safeCall([=] {
+                if (gen != gen_) {
+                    return;
+                }
+                held_ = again;
+                if (err.size()) {
+                    error("anti-entropy repair failed %s", err.c_str());
+                    finish_("repair failed");
+                    return;
+                } else if (again) { //the channel is held, a page read again is not behind it
+                    sendNext_();
+                    return;
+                }
+                repaired_ += n;
+                if (last.empty()) {
+                    repairs_.pop_front();
+                    repairInc_ = true;
+                } else {
+                    repairFrom_ = last;
+                    repairInc_ = false;
+                }
+                sendNext_();
+            });
+        });
+    }
+}
+
+void AntiEntropy::finish_(const char* err) {
+    if (!running_) {
+        return;
+    }
+    if (err) {
+        error("anti-entropy stopped: %s", err);
+    }
+    info("anti-entropy %ld ranges checked %ld pieces differ %ld keys repaired",
+        (long)checked_.load(), (long)differ_.load(), (long)repaired_.load());
+    gen_ ++;
+    if (held_) {
+        size_t idx = idx_;
+        wpool_->addTask([=] { db_->holdSync(idx, false); });
+        held_ = false;
+    }
+    todo_.clear();
+    repairs_.clear();
+    repairInc_ = true;
+    running_ = false;
+    con_->close();
+}
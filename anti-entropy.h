@@ -0,0 +1,54 @@
+#pragma once
+#include <handy/handy.h>
+#include <handy/http.h>
+#include <handy/threads.h>
+#include <deque>
+#include "logdb.h"
+
+using namespace std;
+using namespace handy;
+
+//a range-get page of master being repaired
+struct RepairPage {
+    string from, end;
+    bool inc; //whether from is included
+    int masterDbid;
+    int64_t fileno, offset; //master binlog position before the page was read
+};
+
+//checks the data of this slave against a master and repairs the ranges that differ.
+//the master splits a range into parts with hashes, a part differing from the local hash is split again,
+//until it is a single piece of the master, which is copied by range-get and keys missing on master are deleted.
+//bytes transferred grow with the damage, not with the size of db.
+//a page is applied with the versions of master while binlog of the channel is held, after the channel reaches
+//the master binlog position the page was read at, so later binlog is applied after the page
+struct AntiEntropy {
+    AntiEntropy(LogDb* db, EventBase* base, ThreadPool* wpool): db_(db), base_(base), wpool_(wpool), pool_(1),
+        running_(false), checked_(0), differ_(0), repaired_(0), idx_(0), repair_(false), hashing_(false), repairInc_(true), held_(false), gen_(0) {}
+    //check against master of channel idx, only count differences if repair is false. false if a check is running
+    bool start(size_t idx, bool repair);
+    void exit() { pool_.exit().join(); }
+
+    LogDb* db_;
+    EventBase* base_;
+    ThreadPool* wpool_;
+    ThreadPool pool_; //hashes local ranges
+    atomic<bool> running_;
+    atomic<int64_t> checked_, differ_, repaired_; //ranges compared, pieces differing, keys rewritten
+
+    //members below are used in the event loop thread
+    size_t idx_;
+    bool repair_;
+    deque<pair<string, string>> todo_; //ranges to compare
+    deque<pair<string, string>> repairs_; //pieces to copy from master
+    bool hashing_; //request in flight is a range-hash
+    string repairFrom_; //key the next range-get page starts from
+    bool repairInc_; //whether repairFrom_ is included
+    bool held_; //binlog of the channel is held for a repair page
+    int64_t gen_; //callbacks of a finished check are ignored
+    TcpConnPtr con_;
+
+    void sendNext_();
+    void onResp_();
+    void finish_(const char* err);
+};
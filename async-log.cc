@@ -0,0 +1,147 @@
+#include "async-log.h"
+#include <stdarg.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+static const char* levelStrs[] = { "FATAL", "ERROR", "UERR", "WARN", "INFO", "DEBUG", "TRACE", "ALL" };
+
+LogRing::LogRing(size_t size): head_(0), tail_(0), tid_(syscall(SYS_gettid)), second_(0) {
+    size_t sz = 4096;
+    while (sz < size) {
+        sz *= 2;
+    }
+    buf_.resize(sz);
+    timeStr_[0] = 0;
+}
+
+bool LogRing::put(const char* p, size_t n) {
+    uint64_t h = head_.load(memory_order_relaxed);
+    uint64_t t = tail_.load(memory_order_acquire);
+    size_t sz = buf_.size();
+    if (sz - (h - t) < n) {
+        return false;
+    }
+    size_t pos = h & (sz - 1);
+    size_t n1 = min(n, sz - pos);
+    memcpy(&buf_[pos], p, n1);
+    memcpy(&buf_[0], p + n1, n - n1);
+    head_.store(h + n, memory_order_release);
+    return true;
+}
+
+size_t LogRing::drain(string* out) {
+    uint64_t t = tail_.load(memory_order_relaxed);
+    uint64_t h = head_.load(memory_order_acquire);
+    size_t sz = buf_.size(), n = h - t;
+    size_t pos = t & (sz - 1);
+    size_t n1 = min(n, sz - pos);
+    out->append(&buf_[pos], n1);
+    out->append(&buf_[0], n - n1);
+    tail_.store(h, memory_order_release);
+    return n;
+}
+
+AsyncLog& AsyncLog::instance() {
+    static AsyncLog log;
+    return log;
+}
+
+void AsyncLog::start(size_t ringSize, int sample) {
+    ringSize_ = ringSize;
+    sample_ = sample;
+    running_ = true;
+    flusher_ = thread([this] {
+        while (running_) {
+            {
+                unique_lock<mutex> lk(mu_);
+                cv_.wait_for(lk, chrono::milliseconds(50), [this] { return !running_; });
+            }
+            flush_();
+        }
+    });
+}
+
+void AsyncLog::stop() {
+    if (!running_) {
+        return;
+    }
+    {
+        lock_guard<mutex> lk(mu_);
+        running_ = false;
+    }
+    cv_.notify_all();
+    flusher_.join();
+    flush_();
+}
+
+bool AsyncLog::sampled() {
+    thread_local uint64_t n = 0;
+    return sample_ > 0 && ++n % sample_ == 0;
+}
+
+LogRing* AsyncLog::ring_() {
+    thread_local shared_ptr<LogRing> ring;
+    if (!ring) {
+        ring.reset(new LogRing(ringSize_));
+        lock_guard<mutex> lk(mu_);
+        rings_.push_back(ring);
+    }
+    return ring.get();
+}
+
+void AsyncLog::logv(int level, const char* file, int line, const char* fmt, ...) {
+    char buf[4096];
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    LogRing* ring = running_ ? ring_() : NULL;
+    char ts[24];
+    char* timeStr = ring ? ring->timeStr_ : ts;
+    //localtime_r is not cheap, a ring formats it once a second
+    if (ring == NULL || ring->second_ != now.tv_sec) {
+        struct tm t;
+        localtime_r(&now.tv_sec, &t);
+        strftime(timeStr, sizeof ts, "%Y/%m/%d-%H:%M:%S", &t);
+        if (ring) {
+            ring->second_ = now.tv_sec;
+        }
+    }
+    const char* base = strrchr(file, '/');
+    int n = snprintf(buf, sizeof buf, "%s.%06ld %lx %s %s:%d ", timeStr, (long)now.tv_usec,
+        ring ? ring->tid_ : (long)syscall(SYS_gettid), levelStrs[level], base ? base + 1 : file, line);
+    va_list args;
+    va_start(args, fmt);
+    n += vsnprintf(buf + n, sizeof buf - n, fmt, args);
+    va_end(args);
+    n = min(n, (int)sizeof buf - 1);
+    buf[n++] = '\n';
+    if (ring == NULL) {
+        int r = ::write(Logger::getLogger().getFd(), buf, n);
+        (void)r;
+    } else if (!ring->put(buf, n)) {
+        drops_ ++;
+    }
+}
+
+void AsyncLog::flush_() {
+    vector<shared_ptr<LogRing>> rings;
+    {
+        lock_guard<mutex> lk(mu_);
+        rings = rings_;
+    }
+    string out;
+    for (auto& r: rings) {
+        r->drain(&out);
+    }
+    //lines of different threads are not merged by time, each line carries its own time
+    int fd = Logger::getLogger().getFd();
+    for (size_t off = 0; off < out.size(); ) {
+        ssize_t r = ::write(fd, out.data() + off, out.size() - off);
+        if (r <= 0) {
+            break;
+        }
+        off += r;
+    }
+    bytes_ += out.size();
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <handy/logging.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace handy;
+
+//log of hot paths. formatting is skipped when the level is disabled, lines go into a ring buffer of the calling thread
+//and are written to the log file of handy by a background thread. before start and after stop lines are written directly
+#define alog(level, ...) \
+    do { if (level <= Logger::getLogger().getLogLevel()) { AsyncLog::instance().logv(level, __FILE__, __LINE__, __VA_ARGS__); } } while(0)
+#define adebug(...) alog(Logger::LDEBUG, __VA_ARGS__)
+#define ainfo(...) alog(Logger::LINFO, __VA_ARGS__)
+//per request access log, only 1 of access_log_sample requests is logged
+#define accesslog(...) \
+    do { if (Logger::LINFO <= Logger::getLogger().getLogLevel() && AsyncLog::instance().sampled()) { \
+        AsyncLog::instance().logv(Logger::LINFO, __FILE__, __LINE__, __VA_ARGS__); } } while(0)
+
+//single producer single consumer ring of log bytes. the owner thread appends, the flusher drains
+struct LogRing {
+    vector<char> buf_;
+    atomic<uint64_t> head_, tail_;
+    long tid_;
+    time_t second_; //time cached in timeStr_
+    char timeStr_[24];
+    LogRing(size_t size);
+    //false if there is no room, the line is dropped
+    bool put(const char* p, size_t n);
+    size_t drain(string* out);
+};
+
+struct AsyncLog {
+    static AsyncLog& instance();
+    //ringSize is bytes of ring per thread, sample is 1 in how many requests are access logged, 0 for none
+    void start(size_t ringSize, int sample);
+    void stop();
+    void logv(int level, const char* file, int line, const char* fmt, ...) __attribute__((format(printf, 5, 6)));
+    bool sampled();
+
+    atomic<int64_t> drops_, bytes_;
+private:
+    AsyncLog(): drops_(0), bytes_(0), running_(false), ringSize_(0), sample_(1) {}
+    LogRing* ring_();
+    void flush_();
+    atomic<bool> running_;
+    size_t ringSize_;
+    int sample_;
+    mutex mu_; //guards rings_ and wakes the flusher
+    condition_variable cv_;
+    vector<shared_ptr<LogRing>> rings_;
+    thread flusher_;
+};
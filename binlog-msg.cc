@@ -1,5 +1,6 @@
 #include "binlog-msg.h"
 #include "handler.h"
+#include "async-log.h"
 
 void handleBinlog(LogDb* db, EventBase* base, const HttpConnPtr& con) {
     HttpRequest& req = con.getRequest();
@@ -15,8 +16,25 @@ void handleBinlog(LogDb* db, EventBase* base, const HttpConnPtr& con) {
     pos.offset = util::atoi(soff.c_str());
     HttpResponse& resp = con.getResponse();
     resp.headers["req-info"] = pos.toString();
+    resp.headers["dbid"] = util::format("%d", db->dbid_);
     SyncPos npos = pos;
-    Status st = db->fetchLogLock(&npos.fileno, &npos.offset, &resp.body, con);
+    string tm = req.getArg("t");
+    if (pos.fileno < 0 && tm.size()) { //slave starting from a time, answer the position only
+        Status s = db->findBinlogPosLock(util::atoi(tm.c_str()), &npos.fileno, &npos.offset);
+        if (!s.ok()) {
+            resp.setStatus(500, s.toString());
+        }
+        resp.headers["next-info"] = npos.toString();
+        base->safeCall([con]{con.sendResponse(); });
+        return;
+    }
+    KeyFilter filter;
+    if (!filter.parse(req.getArg("filter"))) {
+        resp.setStatus(400, "bad filter");
+        base->safeCall([con]{con.sendResponse(); });
+        return;
+    }
+    Status st = db->fetchLogLock(&npos.fileno, &npos.offset, &resp.body, con, filter);
     if (!st.ok()) {
         con.getResponse().setStatus(500, st.toString());
         base->safeCall([con]{con.sendResponse(); });
@@ -25,15 +43,107 @@ void handleBinlog(LogDb* db, EventBase* base, const HttpConnPtr& con) {
         return;
     }
     resp.headers["next-info"] = npos.toString();
-    info("binlog response req-info '%s' next-info '%s' body len %ld", 
+    ainfo("binlog response req-info '%s' next-info '%s' body len %ld", 
         resp.getHeader("req-info").c_str(), resp.getHeader("next-info").c_str(), resp.body.size());
     base->safeCall([con]{con.sendResponse(); });
 }
 
-void addBinlogHeader(Slice bkey, Slice ekey, HttpRequest& req, HttpResponse& resp) {
+//decoded events of records in data, read from fileno starting at offset
+static Status encodeCdcEvents(LogDb* db, Slice data, int64_t fileno, int64_t offset, const KeyFilter& filter, bool keysOnly,
+    string* body, int64_t* n) {
+    Slice record;
+    LogRecord rec;
+    Status st;
+    string kskey;
+    while (data.size() && (st=LogFile::decodeBinlogData(&data, &record), st.ok())) {
+        offset += LogFile::totalLen(record.size());
+        st = LogRecord::decodeRecord(record, &rec);
+        if (!st.ok()) {
+            break;
+        }
+        Keyspace* ks = rec.ks ? db->keyspaces_.byId(rec.ks) : NULL;
+        if (ks) { //keys of other keyspaces are given as <name>/<key>, as they are addressed
+            kskey = ks->name + "/" + rec.key.toString();
+            rec.key = kskey;
+        }
+        if (!filter.match(rec.key)) {
+            continue;
+        }
+        Slice value;
+        rec.decodeValue(&value);
+        bool hasValue = !keysOnly && rec.op == BinlogWrite;
+        body->append(util::format("%s %ld %ld %ld %d %ld %ld\n", rec.op == BinlogWrite ? "set" : "del",
+            (long)fileno, (long)offset, (long)rec.tm, rec.dbid, (long)rec.key.size(), hasValue ? (long)value.size() : -1L));
+        body->append(rec.key.data(), rec.key.size());
+        if (hasValue) {
+            body->append(value.data(), value.size());
+        }
+        body->append("\n");
+        ++*n;
+    }
+    return st;
+}
+
+void handleCdc(LogDb* db, EventBase* base, const HttpConnPtr& con) {
+    HttpRequest& req = con.getRequest();
+    HttpResponse& resp = con.getResponse();
+    string sf = req.getArg("f");
+    string soff = req.getArg("off");
+    string tm = req.getArg("t");
+    int64_t fileno = util::atoi(sf.c_str()), offset = util::atoi(soff.c_str());
+    Status st;
+    if ((sf.empty() || soff.empty()) && tm.empty()) {
+        st = Status::fromFormat(EINVAL, "f and off or t should be given");
+    } else if (sf.empty() || soff.empty()) {
+        st = db->findBinlogPosLock(util::atoi(tm.c_str()), &fileno, &offset);
+    }
+    string spec;
+    for (auto& p: Slice(req.getArg("prefix")).split(',')) {
+        if (p.size()) {
+            spec += (spec.size() ? "," : "") + p.toString() + "*";
+        }
+    }
+    KeyFilter filter;
+    filter.parse(spec);
+    if (st.ok() && db->binlogDir_.empty()) {
+        st = Status::fromFormat(EINVAL, "binlog not enabled");
+    }
+    if (!st.ok()) {
+        resp.setStatus(400, st.msg());
+        base->safeCall([con]{con.sendResponse(); });
+        return;
+    }
+    resp.headers["req-info"] = util::format("%ld %ld", (long)fileno, (long)offset);
+    resp.headers["dbid"] = util::format("%d", db->dbid_);
+    int64_t nfile = fileno, noff = offset;
+    string data;
+    //filtered in the loop below, where the position of each record is known
+    st = db->fetchLogLock(&nfile, &noff, &data, con, KeyFilter());
+    if (st.ok() && nfile == fileno && noff == offset) { //parked until records are written
+        return;
+    }
+    int64_t n = 0;
+    if (st.ok()) {
+        st = encodeCdcEvents(db, data, fileno, offset, filter, req.getArg("keys") == "1", &resp.body, &n);
+    }
+    if (!st.ok()) {
+        resp.body.clear();
+        resp.setStatus(500, st.toString());
+    } else {
+        db->cdcEvents_ += n;
+        resp.headers["next-info"] = util::format("%ld %ld", (long)nfile, (long)noff);
+        resp.headers["events"] = util::format("%ld", (long)n);
+    }
+    adebug("cdc response req-info '%s' next-info '%s' events %ld",
+        resp.getHeader("req-info").c_str(), resp.getHeader("next-info").c_str(), (long)n);
+    base->safeCall([con]{con.sendResponse(); });
+}
+
+void addBinlogHeader(LogDb* db, Slice bkey, Slice ekey, HttpRequest& req, HttpResponse& resp) {
     string reqinfo = req.getHeader("req-info");
     if (reqinfo.size()) {
         resp.headers["req-info"] = reqinfo;
+        resp.headers["dbid"] = util::format("%d", db->dbid_);
         SyncPos pos;
         bool r = pos.fromString(reqinfo, ' ');
         if (!r) {
@@ -60,75 +170,165 @@ void sendEmptyBinlog(EventBase* base, LogDb* db) {
     }
 }
 
-void sendSyncReq(LogDb* db, EventBase* base, const HttpConnPtr& con) {
-    SlaveStatus ss = db->getSlaveStatusLock();
+void startSync(const SyncChannelPtr& ch, const HttpConnPtr& con) {
+    //queued behind the batches of the previous connection, so the saved position is final
+    ch->wpool->addTask([ch, con] {
+        SlaveStatus ss = ch->db->getSlaveStatusLock(ch->idx);
+        ch->fetchPos = ss.pos;
+        ch->startTime = ss.startTime;
+        ch->base->safeCall([ch, con] { sendSyncReq(ch, con); });
+    });
+}
+
+void sendSyncReq(const SyncChannelPtr& ch, const HttpConnPtr& con) {
+    SyncPos& pos = ch->fetchPos;
     HttpRequest& req = con.getRequest();
-    req.headers["req-info"] = ss.pos.toString();
-    if (!ss.pos.dataFinished) {
-        req.query_uri = "/range-get/" + ss.pos.key;
+    req.headers["req-info"] = pos.toString();
+    if (!pos.dataFinished) {
+        req.query_uri = "/range-get/" + pos.key;
+    } else if (pos.fileno < 0 && ch->startTime > 0) {
+        req.query_uri = util::format("/binlog/?f=-1&off=-1&t=%ld", (long)ch->startTime);
     } else {
-        req.query_uri = util::format("/binlog/?f=%05ld&off=%ld", ss.pos.fileno, ss.pos.offset);
+        req.query_uri = util::format("/binlog/?f=%05ld&off=%ld", pos.fileno, pos.offset);
     }
-    debug("geting %s", req.query_uri.c_str());
-    base->safeCall([con] { con.sendRequest();});
+    if (g_sync_filter.size()) {
+        req.query_uri += (pos.dataFinished ? "&filter=" : "?filter=") + g_sync_filter;
+    }
+    adebug("geting %s", req.query_uri.c_str());
+    con.sendRequest();
 }
 
-void processSyncResp(LogDb* db, const HttpConnPtr& con, EventBase* base) {
-    bool isError = true;
-    ExitCaller atend([&]{ if (isError) con->close(); else sendSyncReq(db, base, con); });
+struct SyncBatch {
+    int masterDbid;
+    SyncPos pos, next;
+    string body;
+    vector<LogRecord> recs; //slices point into body
+    deque<string> values; //values of the copy given a version, referenced by recs
+};
 
-    HttpResponse& res = con.getResponse();
-    if (res.status != 200) {
-        error("response error. code %d", res.status);
-        return;
-    }
-    Slice body = res.getBody();
-    string reqinfo = res.getHeader("req-info");
-    SyncPos pos;
-    bool r = pos.fromString(reqinfo, ' ');
-    if (!r) {
-        error("unexpected header req-info '%s'", reqinfo.data());
-        return;
-    }
-    SlaveStatus ss = db->getSlaveStatusLock();
-    if (pos != ss.pos) {
-        error("header req-info '%s' not match slave status '%s'",
-            pos.toString().c_str(), ss.pos.toString().c_str());
-        return;
+//rows copied are written by the master, unversioned ones get version 0 of the master,
+//so binlog records after the start position, which are newer, are not dropped as conflicts
+LogRecord copiedRecord(LogDb* db, int masterDbid, Slice key, Slice value, deque<string>* values) {
+    int dbid = masterDbid > 0 ? masterDbid : db->dbid_;
+    Slice v;
+    BinlogOp op = LogDb::decodeValue(value, &v) ? BinlogWrite : BinlogDelete;
+    ValueMeta meta;
+    ValueMeta::decode(value, &meta, &v);
+    if (db->versioned_ && !meta.hasVersion()) {
+        meta.flags |= ValueMeta::HasVersion;
+        meta.ts = 0;
+        meta.dbid = dbid;
+        values->push_back(string());
+        value = meta.encode(v, &values->back());
     }
+    return LogRecord(dbid, time(NULL), key, value, op);
+}
 
+static Status decodeSyncBody(LogDb* db, SyncBatch* b) {
     Status st;
-    if (pos.dataFinished == 0) { //range-get resp
+    Slice body = b->body;
+    if (b->pos.dataFinished == 0) { //range-get resp
         Slice key, value;
         bool exist;
         while (body.size() && (st=decodeKvBody(&body, &key, &value, &exist), st.ok())) {
-            st = db->write(key, value);
-            if (!st.ok()) {
-                break;
-            }
+            b->recs.push_back(copiedRecord(db, b->masterDbid, key, value, &b->values));
         }
     } else { //binlog resp
         Slice record;
+        LogRecord rec;
         while (body.size() && (st=LogFile::decodeBinlogData(&body, &record), st.ok())) {
-            st = db->applyLog(record);
+            st = LogRecord::decodeRecord(record, &rec);
             if (!st.ok()) {
                 break;
             }
+            if (rec.dbid != db->dbid_) { //ignore if dbid is self
+                b->recs.push_back(rec);
+            }
         }
     }
+    return st;
+}
+
+static void applySyncBatch(const SyncChannelPtr& ch, const HttpConnPtr& con, const shared_ptr<SyncBatch>& b) {
+    LogDb* db = ch->db;
+    Status st;
+    if (ch->closed) { //a new connection refetches from the saved position
+        return;
+    }
+    if (db->parkSync(ch->idx, [ch, con, b] { applySyncBatch(ch, con, b); })) { //anti-entropy is repairing
+        return;
+    }
+    SlaveStatus ss = db->getSlaveStatusLock(ch->idx);
+    if (b->pos != ss.pos) {
+        st = Status::fromFormat(EINVAL, "batch '%s' not match slave status '%s'",
+            b->pos.toString().c_str(), ss.pos.toString().c_str());
+    } else if (b->recs.size()) {
+        st = db->applyLogs(b->recs, true);
+    }
     if (st.ok()) {
-        string nextinfo = res.getHeader("next-info");
-        SyncPos pos;
-        bool r = pos.fromString(nextinfo, ' ');
-        if (!r) {
-            error("unexpected header next-info %s", nextinfo.c_str());
+        time_t lag = b->recs.size() ? time(NULL) - b->recs.back().tm : 0;
+        db->addSyncStatsLock(ch->idx, b->recs.size(), b->body.size(), lag, b->masterDbid);
+        st = db->updateSlaveStatusLock(ch->idx, b->next);
+    } else {
+        error("apply sync batch failed: %s", st.toString().c_str());
+    }
+    bool failed = !st.ok();
+    ch->base->safeCall([ch, con, failed] {
+        ch->applying--;
+        if (failed) {
             con->close();
-            return;
-        } else {
-            st = db->updateSlaveStatusLock(pos);
+        } else if (ch->stalled) {
+            ch->stalled = false;
+            sendSyncReq(ch, con);
         }
-    }
-    isError = false;
+    });
 }
 
-
+void processSyncResp(const SyncChannelPtr& ch, const HttpConnPtr& con) {
+    HttpResponse& res = con.getResponse();
+    if (res.status != 200) {
+        error("response error. code %d", res.status);
+        con->close();
+        return;
+    }
+    shared_ptr<SyncBatch> b(new SyncBatch);
+    string reqinfo = res.getHeader("req-info");
+    string nextinfo = res.getHeader("next-info");
+    if (!b->pos.fromString(reqinfo, ' ')) {
+        error("unexpected header req-info '%s'", reqinfo.c_str());
+        con->close();
+        return;
+    }
+    if (b->pos != ch->fetchPos) {
+        error("header req-info '%s' not match fetch pos '%s'",
+            b->pos.toString().c_str(), ch->fetchPos.toString().c_str());
+        con->close();
+        return;
+    }
+    if (!b->next.fromString(nextinfo, ' ')) {
+        error("unexpected header next-info %s", nextinfo.c_str());
+        con->close();
+        return;
+    }
+    string dbid = res.getHeader("dbid");
+    b->masterDbid = dbid.size() ? util::atoi(dbid.c_str()) : -1;
+    if (res.body2.size()) {
+        b->body = res.body2;
+    } else {
+        b->body.swap(res.body);
+    }
+    con.clearData();
+    Status st = decodeSyncBody(ch->db, b.get());
+    if (!st.ok()) {
+        con->close();
+        return;
+    }
+    ch->fetchPos = b->next;
+    ch->applying++;
+    ch->wpool->addTask([ch, con, b] { applySyncBatch(ch, con, b); });
+    if (ch->applying < g_sync_pipeline) {
+        sendSyncReq(ch, con);
+    } else {
+        ch->stalled = true;
+    }
+}
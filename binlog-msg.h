@@ -2,6 +2,7 @@
 #include <handy/handy.h>
 #include <handy/http.h>
 #include <handy/conf.h>
+#include <handy/threads.h>
 #include "leveldb/db.h"
 #include "globals.h"
 #include "logdb.h"
@@ -9,9 +10,33 @@
 using namespace std;
 using namespace handy;
 
-void addBinlogHeader(Slice bkey, Slice ekey, HttpRequest& req, HttpResponse& resp);
+void addBinlogHeader(LogDb* db, Slice bkey, Slice ekey, HttpRequest& req, HttpResponse& resp);
 void handleBinlog(LogDb* db, EventBase* base, const HttpConnPtr& con);
+//decoded change events after a binlog position for external consumers, see README
+void handleCdc(LogDb* db, EventBase* base, const HttpConnPtr& con);
 void sendEmptyBinlog(EventBase* base, LogDb* db);
-void sendSyncReq(LogDb* db, EventBase* base, const HttpConnPtr& con);
-void processSyncResp(LogDb* db, const HttpConnPtr& con, EventBase* base);
+//record applying a row of a master range-get with req-info, the stored value with version or deleted mark.
+//values keeps the value when it is given a version
+LogRecord copiedRecord(LogDb* db, int masterDbid, Slice key, Slice value, deque<string>* values);
+
+//state of one connection to the master. fetching and decoding run in the event loop thread,
+//applying runs in the write pool, so the next batch is on the wire while the current one is applied
+struct SyncChannel {
+    LogDb* db;
+    EventBase* base;
+    ThreadPool* wpool;
+    size_t idx; //index of the master in LogDb::slaves_
+    SyncPos fetchPos; //position of the request in flight
+    time_t startTime; //master resolves it to a position when fetchPos.fileno is -1
+    int applying; //batches queued in the write pool
+    bool stalled; //next request is deferred until a batch is applied
+    atomic<bool> closed;
+    SyncChannel(LogDb* db1, EventBase* base1, ThreadPool* wpool1, size_t idx1):
+        db(db1), base(base1), wpool(wpool1), idx(idx1), startTime(0), applying(0), stalled(false), closed(false) {}
+};
+typedef shared_ptr<SyncChannel> SyncChannelPtr;
+
+void startSync(const SyncChannelPtr& ch, const HttpConnPtr& con);
+void sendSyncReq(const SyncChannelPtr& ch, const HttpConnPtr& con);
+void processSyncResp(const SyncChannelPtr& ch, const HttpConnPtr& con);
 
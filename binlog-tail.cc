@@ -0,0 +1,73 @@
+#include "binlog-tail.h"
+#include "logfile.h"
+
+static const size_t SEG_SIZE = 1024*1024;
+
+void BinlogTail::append(int64_t fileno, int64_t offset, Slice record) {
+    if (capacity_ <= 0) {
+        return;
+    }
+    int64_t head[2] = { LOG_MAGIC, (int64_t)record.size() };
+    size_t padded = LogFile::totalLen(record.size());
+    lock_guard<mutex> lk(mu_);
+    Seg* last = segs_.size() ? &segs_.back() : NULL;
+    if (last == NULL || last->fileno != fileno || last->offset + (int64_t)last->data.size() != offset
+        || last->data.size() + padded > max(SEG_SIZE, padded)) {
+        segs_.push_back(Seg());
+        last = &segs_.back();
+        last->fileno = fileno;
+        last->offset = offset;
+        last->data.reserve(max(SEG_SIZE, padded));
+    }
+    last->data.append((const char*)head, sizeof head);
+    last->data.append(record.data(), record.size());
+    last->data.append(padded - sizeof head - record.size(), '\0');
+    bytes_ += padded;
+    while (bytes_ > capacity_ && segs_.size() > 1) {
+        bytes_ -= segs_.front().data.size();
+        segs_.pop_front();
+    }
+}
+
+bool BinlogTail::read(int64_t fileno, int64_t offset, size_t maxBytes, string* out) {
+    lock_guard<mutex> lk(mu_);
+    size_t i = segs_.size();
+    while (i > 0 && !(segs_[i-1].fileno == fileno && segs_[i-1].offset <= offset
+        && offset < segs_[i-1].offset + (int64_t)segs_[i-1].data.size())) {
+        i --;
+    }
+    if (i == 0) {
+        misses_ ++;
+        return false;
+    }
+    //copy whole records of this and the following contiguous segs
+    for (i --; i < segs_.size() && segs_[i].fileno == fileno; i ++) {
+        Seg& s = segs_[i];
+        if (s.offset > offset) {
+            break;
+        }
+        const char* p = s.data.data() + (offset - s.offset);
+        const char* b = p;
+        const char* pe = s.data.data() + s.data.size();
+        while (p < pe) {
+            int64_t len = *(int64_t*)(p+8);
+            size_t tlen = LogFile::totalLen(len);
+            if (*(int64_t*)p != LOG_MAGIC || len < 0 || p + tlen > pe) { //not at a record, let the file reader report it
+                out->clear();
+                misses_ ++;
+                return false;
+            }
+            if (out->size() + (p - b) + tlen > maxBytes && (out->size() || p > b)) {
+                break;
+            }
+            p += tlen;
+        }
+        out->append(b, p);
+        offset += p - b;
+        if (p < pe) {
+            break;
+        }
+    }
+    hits_ ++;
+    return true;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <handy/slice.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+
+using namespace std;
+using namespace handy;
+
+//the most recent binlog records in memory, framed as in binlog files.
+//readers at recent positions, slaves and cdc subscribers, share it instead of reading the file each
+struct BinlogTail {
+    BinlogTail(): capacity_(0), bytes_(0), hits_(0), misses_(0) {}
+    void init(int64_t capacity) { capacity_ = capacity; }
+    bool enabled() { return capacity_ > 0; }
+    //record written at fileno/offset, called in write thread after it is in the file
+    void append(int64_t fileno, int64_t offset, Slice record);
+    //framed records from fileno/offset, whole records up to maxBytes but at least one.
+    //false if the position is not in memory
+    bool read(int64_t fileno, int64_t offset, size_t maxBytes, string* out);
+
+    struct Seg {
+        int64_t fileno, offset;
+        string data;
+    };
+    mutex mu_;
+    deque<Seg> segs_;
+    int64_t capacity_, bytes_;
+    atomic<int64_t> hits_, misses_;
+};
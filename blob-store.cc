@@ -0,0 +1,170 @@
+#include "blob-store.h"
+#include <handy/logging.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <algorithm>
+
+Status BlobStore::init(const string& dir, int64_t fileSize) {
+    dir_ = dir;
+    fileSize_ = fileSize;
+    file::createDir(dir_); //ignore return value
+    vector<string> files;
+    Status st = file::getChildren(dir_, &files);
+    if (!st.ok()) {
+        return st;
+    }
+    for (auto& f: files) {
+        if (Slice(f).starts_with(prefix())) {
+            int64_t no = util::atoi(f.c_str() + prefix().size());
+            st = open_(no);
+            if (!st.ok()) {
+                return st;
+            }
+            lastFile_ = max(lastFile_, no);
+        }
+    }
+    if (lastFile_ == 0) {
+        lastFile_ = 1;
+        st = open_(lastFile_);
+    }
+    if (st.ok()) {
+        lastSize_ = lseek(files_[lastFile_]->fd_, 0, SEEK_END);
+        info("blob store %s opened %ld files", dir_.c_str(), (long)files_.size());
+    }
+    return st;
+}
+
+Status BlobStore::open_(int64_t no) {
+    BlobFilePtr bf(new BlobFile);
+    bf->name_ = dir_ + fileName(no);
+    bf->fd_ = ::open(bf->name_.c_str(), O_RDWR|O_APPEND|O_CREAT, 0622);
+    if (bf->fd_ < 0) {
+        Status st = Status::ioError("open", bf->name_);
+        error("%s", st.toString().c_str());
+        return st;
+    }
+    lock_guard<mutex> lk(*this);
+    files_[no] = bf;
+    return Status();
+}
+
+BlobFilePtr BlobStore::get_(int64_t no) {
+    lock_guard<mutex> lk(*this);
+    auto p = files_.find(no);
+    return p == files_.end() ? BlobFilePtr() : p->second;
+}
+
+Status BlobStore::append(Slice key, Slice value, int64_t* fileno, int64_t* offset) {
+    Status st;
+    if (lastSize_ >= fileSize_) {
+        st = sync();
+        if (st.ok()) {
+            st = open_(lastFile_ + 1);
+        }
+        if (!st.ok()) {
+            return st;
+        }
+        lock_guard<mutex> lk(*this);
+        lastFile_ ++;
+        lastSize_ = 0;
+    }
+    BlobFilePtr bf = get_(lastFile_);
+    int32_t head[2] = { (int32_t)key.size(), (int32_t)value.size() };
+    struct iovec iov[3] = {
+        { head, sizeof head },
+        { (void*)key.data(), key.size() },
+        { (void*)value.data(), value.size() },
+    };
+    ssize_t total = sizeof head + key.size() + value.size();
+    ssize_t w = writev(bf->fd_, iov, 3);
+    if (w != total) {
+        st = Status::ioError("writev", bf->name_);
+        error("%s", st.toString().c_str());
+        return st;
+    }
+    *fileno = lastFile_;
+    *offset = lastSize_ + sizeof head + key.size();
+    lastSize_ += total;
+    return st;
+}
+
+Status BlobStore::sync() {
+    BlobFilePtr bf = get_(lastFile_);
+    if (bf && fsync(bf->fd_) < 0) {
+        Status st = Status::ioError("fsync", bf->name_);
+        error("%s", st.toString().c_str());
+        return st;
+    }
+    return Status();
+}
+
+Status BlobStore::read(int64_t fileno, int64_t offset, int64_t size, string* value) {
+    BlobFilePtr bf = get_(fileno);
+    if (!bf) {
+        return Status::fromFormat(EIO, "blob file %ld not exists", (long)fileno);
+    }
+    value->resize(size);
+    ssize_t r = pread(bf->fd_, &(*value)[0], size, offset);
+    if (r != size) {
+        Status st = Status::fromFormat(EIO, "read blob %s offset %ld size %ld returned %ld",
+            bf->name_.c_str(), (long)offset, (long)size, (long)r);
+        error("%s", st.toString().c_str());
+        return st;
+    }
+    return Status();
+}
+
+Status BlobStore::readRecord(int64_t fileno, int64_t* offset, string* key, int64_t* valueOffset, string* value) {
+    key->clear();
+    BlobFilePtr bf = get_(fileno);
+    if (!bf) {
+        return Status::fromFormat(EIO, "blob file %ld not exists", (long)fileno);
+    }
+    int32_t head[2] = {0, 0};
+    ssize_t r = pread(bf->fd_, head, sizeof head, *offset);
+    if (r == 0) {
+        return Status();
+    }
+    if (r != sizeof head || head[0] <= 0 || head[1] < 0) {
+        Status st = Status::fromFormat(EINVAL, "bad blob record in %s offset %ld", bf->name_.c_str(), (long)*offset);
+        error("%s", st.toString().c_str());
+        return st;
+    }
+    Status st = read(fileno, *offset + sizeof head, head[0], key);
+    if (st.ok()) {
+        *valueOffset = *offset + sizeof head + head[0];
+        st = read(fileno, *valueOffset, head[1], value);
+    }
+    if (st.ok()) {
+        *offset = *valueOffset + head[1];
+    } else {
+        key->clear();
+    }
+    return st;
+}
+
+vector<int64_t> BlobStore::closedFiles() {
+    lock_guard<mutex> lk(*this);
+    vector<int64_t> r;
+    for (auto& p: files_) {
+        if (p.first != lastFile_) {
+            r.push_back(p.first);
+        }
+    }
+    return r;
+}
+
+Status BlobStore::remove(int64_t fileno) {
+    BlobFilePtr bf;
+    {
+        lock_guard<mutex> lk(*this);
+        auto p = files_.find(fileno);
+        if (p == files_.end() || fileno == lastFile_) {
+            return Status();
+        }
+        bf = p->second;
+        files_.erase(p);
+    }
+    info("removing blob file %s", bf->name_.c_str());
+    return file::deleteFile(bf->name_); //readers still holding bf keep the fd valid
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <handy/handy.h>
+#include <handy/file.h>
+#include <map>
+#include <memory>
+
+using namespace std;
+using namespace handy;
+
+//values not smaller than blob_threshold are kept in append only blob files,
+//leveldb keeps only a pointer to them, so compactions do not rewrite large values
+//record format
+// keylen valuelen key value
+// 4      4
+struct BlobFile {
+    int fd_;
+    string name_;
+    BlobFile(): fd_(-1) {}
+    ~BlobFile() { if (fd_ >= 0) { close(fd_); } }
+};
+typedef shared_ptr<BlobFile> BlobFilePtr;
+
+struct BlobStore: public mutex {
+    BlobStore(): fileSize_(0), lastFile_(0), lastSize_(0) {}
+    Status init(const string& dir, int64_t fileSize);
+    bool enabled() { return dir_.size(); }
+    //called in write thread. *offset is where the value begins
+    Status append(Slice key, Slice value, int64_t* fileno, int64_t* offset);
+    Status sync();
+    Status read(int64_t fileno, int64_t offset, int64_t size, string* value);
+    //read the record at *offset and move *offset to the next one, key is empty at end of file
+    Status readRecord(int64_t fileno, int64_t* offset, string* key, int64_t* valueOffset, string* value);
+    //files no longer appended, in order
+    vector<int64_t> closedFiles();
+    Status remove(int64_t fileno);
+    int64_t fileCount() { lock_guard<mutex> lk(*this); return files_.size(); }
+
+    static string prefix() { return "blob-"; }
+    static string fileName(int64_t no) { return prefix()+util::format("%05ld", no); }
+
+    string dir_;
+    int64_t fileSize_;
+    int64_t lastFile_;
+    int64_t lastSize_;
+    map<int64_t, BlobFilePtr> files_;
+
+    Status open_(int64_t no);
+    BlobFilePtr get_(int64_t no);
+};
@@ -0,0 +1,126 @@
+#include "compactor.h"
+#include <handy/logging.h>
+#include <memory>
+#include <unistd.h>
+
+void getLevelBytes(leveldb::DB* db, int64_t bytes[LEVELDB_LEVELS]) {
+    for (int i = 0; i < LEVELDB_LEVELS; i ++) {
+        bytes[i] = 0;
+    }
+    string sst;
+    if (!db->GetProperty("leveldb.sstables", &sst)) {
+        return;
+    }
+    //--- level 1 ---
+    // 12:2097152['a' @ 5 : 1 .. 'k' @ 9 : 1]
+    int level = 0;
+    for (auto& ln: Slice(sst).split('\n')) {
+        if (ln.starts_with("--- level ")) {
+            level = util::atoi(ln.data() + 10);
+        } else if (ln.starts_with(" ") && level >= 0 && level < LEVELDB_LEVELS) {
+            const char* p = (const char*)memchr(ln.data(), ':', ln.size());
+            if (p) {
+                bytes[level] += util::atoi(p+1, ln.end());
+            }
+        }
+    }
+}
+
+void Compactor::init(Conf& conf) {
+    rate_ = conf.getInteger("", "compact_rate", 32) * 1024 * 1024;
+    string win = conf.get("", "compact_window", "");
+    if (win.size()) {
+        vector<Slice> hs = Slice(win).split('-');
+        if (hs.size() == 2) {
+            winBegin_ = util::atoi(hs[0].data(), hs[0].end());
+            winEnd_ = util::atoi(hs[1].data(), hs[1].end());
+        }
+        if (hs.size() != 2 || winBegin_ < 0 || winBegin_ > 23 || winEnd_ < 0 || winEnd_ > 24) {
+            error("bad compact_window %s, should be hours like 2-5", win.c_str());
+            winBegin_ = winEnd_ = -1;
+        }
+    }
+}
+
+bool Compactor::start(const string& begin, const string& end) {
+    bool expected = false;
+    if (!running_.compare_exchange_strong(expected, true)) {
+        return false;
+    }
+    doneBytes_ = 0;
+    pool_.addTask([=] {
+        compact_(begin, end);
+        running_ = false;
+    });
+    return true;
+}
+
+void Compactor::checkWindow() {
+    if (winBegin_ < 0) {
+        return;
+    }
+    time_t now = time(NULL);
+    struct tm t;
+    localtime_r(&now, &t);
+    bool in = winBegin_ <= winEnd_ ? t.tm_hour >= winBegin_ && t.tm_hour < winEnd_
+        : t.tm_hour >= winBegin_ || t.tm_hour < winEnd_;
+    if (in && t.tm_yday != lastWindowDay_ && start("", "")) {
+        info("off peak compaction started");
+        lastWindowDay_ = t.tm_yday;
+    }
+}
+
+void Compactor::compact_(const string& begin, const string& end) {
+    int64_t start = util::timeMilli();
+    info("compaction of [%s, %s) started rate %ld", begin.c_str(), end.c_str(), (long)rate_);
+    if (rate_ <= 0) {
+        compactChunk_(begin, end, 0);
+    } else {
+        //cut the range into chunks by approximate size, checked every 1024 keys.
+        //the iterator is dropped before each chunk, or it would pin the files compacted away
+        leveldb::ReadOptions options;
+        options.fill_cache = false;
+        string chunkBegin = begin;
+        bool last = false;
+        while (!last) {
+            unique_ptr<leveldb::Iterator> it(db_->NewIterator(options));
+            string chunkEnd = end;
+            uint64_t sz = 0;
+            int n = 0;
+            last = true;
+            for (chunkBegin.empty() ? it->SeekToFirst() : it->Seek(chunkBegin); it->Valid(); it->Next()) {
+                if (end.size() && it->key().compare(end) >= 0) {
+                    break;
+                }
+                if (++n % 1024) {
+                    continue;
+                }
+                leveldb::Range r(chunkBegin, it->key());
+                db_->GetApproximateSizes(&r, 1, &sz);
+                if ((int64_t)sz >= rate_) {
+                    chunkEnd = it->key().ToString();
+                    last = false;
+                    break;
+                }
+            }
+            it.reset();
+            compactChunk_(chunkBegin, chunkEnd, sz);
+            chunkBegin = chunkEnd;
+        }
+    }
+    info("compaction of [%s, %s) finished %ld bytes in %ld ms",
+        begin.c_str(), end.c_str(), (long)doneBytes_.load(), (long)(util::timeMilli() - start));
+}
+
+void Compactor::compactChunk_(const string& begin, const string& end, int64_t bytes) {
+    int64_t start = util::timeMilli();
+    leveldb::Slice b(begin), e(end);
+    db_->CompactRange(begin.empty() ? NULL : &b, end.empty() ? NULL : &e);
+    doneBytes_ += bytes;
+    if (rate_ > 0 && bytes) {
+        int64_t left = bytes * 1000 / rate_ - (util::timeMilli() - start);
+        if (left > 0) {
+            usleep(left * 1000);
+        }
+    }
+}
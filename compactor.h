@@ -0,0 +1,37 @@
+#pragma once
+#include <handy/handy.h>
+#include <handy/conf.h>
+#include <handy/threads.h>
+#include "leveldb/db.h"
+
+using namespace std;
+using namespace handy;
+
+const int LEVELDB_LEVELS = 7; //config::kNumLevels of leveldb
+
+//bytes of sstables in each level, parsed from leveldb.sstables
+void getLevelBytes(leveldb::DB* db, int64_t bytes[LEVELDB_LEVELS]);
+
+//manual compaction in a background thread. leveldb can not limit compaction io,
+//so the range is compacted in chunks of about compact_rate bytes with sleeps between them
+struct Compactor {
+    Compactor(leveldb::DB* db): db_(db), pool_(1), running_(false), rate_(0),
+        winBegin_(-1), winEnd_(-1), lastWindowDay_(-1), doneBytes_(0) {}
+    void init(Conf& conf);
+    //empty begin/end for the first/last key. false if a compaction is running
+    bool start(const string& begin, const string& end);
+    //called in timer, start a full compaction once a day in the off peak window
+    void checkWindow();
+    void exit() { pool_.exit().join(); }
+
+    leveldb::DB* db_;
+    ThreadPool pool_;
+    atomic<bool> running_;
+    int64_t rate_; //bytes per second, 0 for no limit
+    int winBegin_, winEnd_; //hours of off peak window, -1 if not set
+    int lastWindowDay_;
+    atomic<int64_t> doneBytes_; //bytes compacted by the running compaction
+
+    void compact_(const string& begin, const string& end);
+    void compactChunk_(const string& begin, const string& end, int64_t bytes);
+};
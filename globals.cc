@@ -5,6 +5,18 @@ int g_page_limit;
 int g_batch_count;
 int g_batch_size;
 int g_flush_slave_interval;
+int g_sync_pipeline;
+int g_ryw_wait;
+int g_expire_rate;
+int64_t g_blob_gc_rate;
+int g_read_queue_limit;
+int g_write_queue_limit;
+int g_queue_wait;
+int g_level0_slowdown;
+int g_level0_stop;
+string g_sync_filter;
+int g_ingest_chunk;
+AdmissionStats g_admission;
 
 void setGlobalConfig(Conf& conf) {
     g_page_limit = g_conf.getInteger("", "page_limit", 1000);
@@ -12,5 +24,16 @@ void setGlobalConfig(Conf& conf) {
     g_batch_size = g_conf.getInteger("", "batch_size", 3);
     g_batch_size *= 1024*1024;
     g_flush_slave_interval = g_conf.getInteger("", "flush_slave_interval", 3);
+    g_sync_pipeline = max(1L, g_conf.getInteger("", "sync_pipeline", 2));
+    g_ryw_wait = g_conf.getInteger("", "ryw_wait", 100);
+    g_expire_rate = g_conf.getInteger("", "expire_rate", 10000);
+    g_blob_gc_rate = g_conf.getInteger("", "blob_gc_rate", 16) * 1024 * 1024;
+    g_read_queue_limit = g_conf.getInteger("", "read_queue_limit", 10000);
+    g_write_queue_limit = g_conf.getInteger("", "write_queue_limit", 10000);
+    g_queue_wait = g_conf.getInteger("", "queue_wait", 3000);
+    g_level0_slowdown = g_conf.getInteger("", "level0_slowdown", 6);
+    g_level0_stop = g_conf.getInteger("", "level0_stop", 10);
+    g_sync_filter = g_conf.get("", "sync_filter", "");
+    g_ingest_chunk = g_conf.getInteger("", "ingest_chunk", 1024) * 1024;
 }
 
@@ -4,6 +4,7 @@
 #include <handy/conf.h>
 #include <handy/status.h>
 #include "leveldb/db.h"
+#include <atomic>
 
 using namespace std;
 using namespace handy;
@@ -13,10 +14,36 @@ extern int g_page_limit;
 extern int g_batch_count;
 extern int g_batch_size;
 extern int g_flush_slave_interval;
+extern int g_sync_pipeline;
+extern int g_ryw_wait;
+extern int g_expire_rate;
+extern int64_t g_blob_gc_rate;
+extern int g_read_queue_limit;
+extern int g_write_queue_limit;
+extern int g_queue_wait;
+extern int g_level0_slowdown;
+extern int g_level0_stop;
+extern string g_sync_filter;
+extern int g_ingest_chunk;
+
+//queue depth and requests rejected by admission control
+struct AdmissionStats {
+    atomic<int64_t> readQueued, writeQueued;
+    atomic<int64_t> queueRejects, waitRejects, level0Rejects;
+    AdmissionStats(): readQueued(0), writeQueued(0), queueRejects(0), waitRejects(0), level0Rejects(0) {}
+};
+extern AdmissionStats g_admission;
 
 void setGlobalConfig(Conf& conf);
 inline leveldb::Slice convSlice(Slice s) { return leveldb::Slice(s.data(), s.size()); }
 inline Slice convSlice(leveldb::Slice s) { return Slice(s.data(), s.size()); }
+inline uint64_t fnv1a(Slice s) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const char* p = s.begin(); p < s.end(); p ++) {
+        h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    return h;
+}
 inline string addSlash(const string& dir) { if (dir.size() && dir[dir.size()-1] != '/') return dir + '/'; return dir; }
 
 struct ConvertStatus {
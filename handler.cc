@@ -1,14 +1,19 @@
 #include "handler.h"
+#include "ingest.h"
 #include "binlog-msg.h"
+#include "alloc-stats.h"
+#include "async-log.h"
+#include <sys/uio.h>
 
 void addKvBody(Slice key, const Slice* value, string* body) {
     body->append(key.data(), key.size());
     char buf[64];
     int cn = snprintf(buf, sizeof buf, "\n%ld\n", value ? (int64_t)value->size() : -1);
     body->append(buf, cn);
-    body->append(value->data(), value->size());
+    if (value) {
+        body->append(value->data(), value->size());
+    }
     body->append("\n");
-
 }
 
 Status decodeKvBody(Slice* body, Slice* key, Slice* value, bool* exists) {
@@ -31,6 +36,7 @@ Status decodeKvBody(Slice* body, Slice* key, Slice* value, bool* exists) {
                     }
                     if (len == -1) {
                         *exists = false;
+                        *body = Slice(min(pe+1, body->end()), body->end());
                     } else {
                         *exists = true;
                         *value = Slice(pe, pe+len);
@@ -67,53 +73,270 @@ Status decodeKeyBody(Slice* body, Slice* key) {
     return inval;
 }
 
+//writes return binlog-pos. reads carrying it as min-pos wait for this db to catch up,
+//or are redirected to the master if it does not in time
+static bool waitMinPos(LogDb* db, HttpRequest& req, HttpResponse& resp) {
+    string mp = req.getHeader("min-pos");
+    if (mp.empty()) {
+        return true;
+    }
+    vector<Slice> ss = Slice(mp).split(' ');
+    if (ss.size() != 3) {
+        resp.setStatus(400, "bad min-pos");
+        return false;
+    }
+    int dbid = util::atoi(ss[0].data());
+    if (dbid == db->dbid_) {
+        return true;
+    }
+    SlaveStatus master;
+    Status st = db->waitSyncedLock(dbid, util::atoi(ss[1].data()), util::atoi(ss[2].data()), g_ryw_wait, &master);
+    if (st.ok()) {
+        return true;
+    }
+    debug("min-pos '%s' %s", mp.c_str(), st.toString().c_str());
+    if (st.code() == ETIMEDOUT) {
+        resp.setStatus(307, "Temporary Redirect");
+        resp.headers["Location"] = util::format("http://%s:%d%s", master.host.c_str(), master.port, req.query_uri.c_str());
+    } else {
+        resp.setStatus(412, "min-pos db not followed");
+    }
+    return false;
+}
+
+static void addPosHeader(LogDb* db, HttpResponse& resp) {
+    string pos = db->binlogPos();
+    if (pos.size()) {
+        resp.headers["binlog-pos"] = pos;
+    }
+}
+
+//reserve the body as large as the last response of the same kind in this thread, so it is not grown by repeated appends
+static void reserveBody(string* body, size_t lastSize) {
+    body->reserve(min(lastSize + lastSize / 8, (size_t)g_batch_size + 64*1024));
+}
+
 static void handleBatchGet(LogDb* db, HttpRequest& req, HttpResponse& resp) {
     Slice key;
     Status st;
-    leveldb::DB* ldb = db->getdb();
     Slice body = req.getBody();
+    static thread_local size_t lastSize = 0;
+    reserveBody(&resp.body, lastSize);
+    string value; //reused for every key
     while (body.size() && st.ok() && (st=decodeKeyBody(&body, &key), st.ok())) {
-        string value;
-        leveldb::Status s = ldb->Get(leveldb::ReadOptions(), convSlice(key), &value);
+        Status s = db->get(leveldb::ReadOptions(), key, &value);
         if (s.ok()) {
+            db->hotKeys_.onRead(key, key.size() + value.size());
             Slice v(value);
             addKvBody(key, &v, &resp.body);
-        } else if (s.IsNotFound()) {
+        } else if (s.code() == ENOENT) {
             addKvBody(key, NULL, &resp.body);
         } else {
-            error("ldb error: %s", s.ToString().c_str());
-            st = (ConvertStatus)s;
+            error("ldb error: %s", s.toString().c_str());
+            st = s;
         }
     }
+    lastSize = resp.body.size();
     if (!st.ok()) {
         resp.setStatus(500, "Internal Error");
     }
 }
 
-static void handleBatchSet(LogDb* db, HttpRequest& req, HttpResponse& resp) {
+time_t getExpire(HttpRequest& req, time_t def) {
+    string ttl = req.getArg("ttl");
+    if (ttl.empty()) {
+        return def;
+    }
+    int64_t sec = util::atoi(ttl.c_str());
+    return sec > 0 ? time(NULL) + sec : 0;
+}
+
+//cas body format: '[expect len]\n[expect][new value]', expect len -1 means key should not exist
+static Status decodeCasBody(Slice body, Slice* expect, bool* exists, Slice* value) {
+    const char* p = body.begin();
+    while (p < body.end() && *p != '\n') {
+        p++;
+    }
+    if (p == body.end()) {
+        return Status::fromFormat(EINVAL, "bad format for cas body");
+    }
+    int64_t len = util::atoi(body.begin(), p);
+    p++;
+    *exists = len >= 0;
+    len = max(len, (int64_t)0);
+    if (p + len > body.end()) {
+        return Status::fromFormat(EINVAL, "bad format for cas body");
+    }
+    *expect = Slice(p, p+len);
+    *value = Slice(p+len, body.end());
+    return Status();
+}
+
+//incr, cas and append, executed in write thread
+static void handleModify(LogDb* db, Slice op, Slice key, HttpRequest& req, HttpResponse& resp) {
+    Status st;
+    if (key.empty()) {
+        resp.setStatus(403, "empty key");
+        return;
+    } else if (isMetaKey(key)) {
+        resp.setStatus(403, "reserved key");
+        return;
+    } else if (req.method != "POST") {
+        resp.setStatus(403, "unknown method");
+        return;
+    }
+    time_t expire = getExpire(req, -1);
+    if (op == "incr") {
+        string delta = req.getArg("delta");
+        int64_t result = 0;
+        st = db->incr(key, delta.size() ? util::atoi(delta.c_str()) : 1, expire, &result);
+        if (st.ok()) {
+            resp.body = util::format("%ld", result);
+        }
+    } else if (op == "cas") {
+        Slice expect, value;
+        bool exists = false;
+        st = decodeCasBody(req.getBody(), &expect, &exists, &value);
+        if (st.ok()) {
+            st = db->cas(key, exists ? &expect : NULL, value, expire);
+        }
+    } else {
+        size_t len = 0;
+        st = db->append(key, req.getBody(), expire, &len);
+        if (st.ok()) {
+            resp.body = util::format("%lu", len);
+        }
+    }
+    if (st.ok()) {
+        addPosHeader(db, resp);
+    } else if (st.code() == ECANCELED) {
+        resp.setStatus(409, "cas failed");
+    } else if (st.code() == EINVAL) {
+        resp.setStatus(400, st.msg());
+    } else {
+        resp.setStatus(500, "Internal Error");
+        error("%.*s error %s", (int)op.size(), op.data(), st.toString().c_str());
+    }
+}
+
+Status applyBatchSet(LogDb* db, Slice body, time_t expire, int64_t* n) {
     Slice key, value;
     Status st;
-    Slice body = req.getBody();
     bool exists;
-    while (body.size() && st.ok() && (st=decodeKvBody(&body, &key, &value, &exists), st.ok())) {
-        st = db->write(key, value);
+    //keys are checked before any is written, so a rejected body leaves nothing behind
+    for (Slice b = body; b.size() && (st=decodeKvBody(&b, &key, &value, &exists), st.ok()); ) {
+        if (isMetaKey(key)) {
+            return Status::fromFormat(EPERM, "reserved key");
+        }
     }
-    if (!st.ok()) {
-        resp.setStatus(500, "Internal Error");
+    while (body.size() && st.ok() && (st=decodeKvBody(&body, &key, &value, &exists), st.ok())) {
+        st = exists ? db->write(key, value, expire) : db->remove(key);
+        ++*n;
     }
+    return st;
 }
 
-static void handleBatchDelete(LogDb* db, HttpRequest& req, HttpResponse& resp) {
+Status applyBatchDelete(LogDb* db, Slice body, int64_t* n) {
     Slice key;
     Status st;
-    Slice body = req.getBody();
+    //keys are checked before any is deleted, as in applyBatchSet
+    for (Slice b = body; b.size() && (st=decodeKeyBody(&b, &key), st.ok()); ) {
+        if (isMetaKey(key)) {
+            return Status::fromFormat(EPERM, "reserved key");
+        }
+    }
     while (body.size() && (st=decodeKeyBody(&body, &key), st.ok())) {
         st = db->remove(key);
         if (!st.ok()) {
             break;
         }
+        ++*n;
+    }
+    return st;
+}
+
+static void handleBatchSet(LogDb* db, HttpRequest& req, HttpResponse& resp) {
+    int64_t n = 0;
+    Status st = applyBatchSet(db, req.getBody(), getExpire(req), &n);
+    if (st.code() == EPERM) {
+        resp.setStatus(403, "reserved key");
+    } else if (!st.ok()) {
+        resp.setStatus(500, "Internal Error");
+    } else {
+        addPosHeader(db, resp);
+    }
+}
+
+static void handleBatchDelete(LogDb* db, HttpRequest& req, HttpResponse& resp) {
+    int64_t n = 0;
+    Status st = applyBatchDelete(db, req.getBody(), &n);
+    if (st.code() == EPERM) {
+        resp.setStatus(403, "reserved key");
+    } else if (!st.ok()) {
+        resp.setStatus(500, "Internal Error");
+    } else {
+        addPosHeader(db, resp);
+    }
+}
+
+//keys with an index term, or terms in [term, end) with query end, and their values in kv-format.
+//entries and values are read from one snapshot, entries whose key no longer has the term are skipped
+static void handleIndexGet(LogDb* db, HttpRequest& req, HttpResponse& resp) {
+    Slice rest = Slice(req.uri).sub(strlen("/index-get/"));
+    const char* slash = (const char*)memchr(rest.data(), '/', rest.size());
+    const IndexDef* def = slash ? db->indexes_.find(Slice(rest.begin(), slash)) : NULL;
+    if (def == NULL) {
+        resp.setStatus(404, "index not found");
+        return;
     }
+    Slice term(slash + 1, rest.end());
+    string end = req.getArg("end");
+    string after = req.getArg("after");
+    leveldb::DB* ldb = db->getdb();
+    leveldb::ReadOptions ro;
+    ro.snapshot = ldb->GetSnapshot();
+    unique_ptr<leveldb::Iterator> it(ldb->NewIterator(ro));
+    string exact = def->entryPrefix() + term.toString() + '\0';
+    string limit = end.size() ? def->entryPrefix() + end : exact;
+    string from = after.size() ? def->entryKey(term, after) : end.size() ? def->entryPrefix() + term.toString() : exact;
+    it->Seek(from);
+    if (after.size() && it->Valid() && it->key() == leveldb::Slice(from)) {
+        it->Next();
+    }
+    string value, t;
+    Slice et, key;
+    int n = 0;
+    Status st;
+    for (; it->Valid(); it->Next()) {
+        Slice entry = convSlice(it->key());
+        if (end.size() ? entry.compare(limit) >= 0 : !entry.starts_with(exact)) {
+            break;
+        }
+        if (!def->decodeEntry(entry, &et, &key)) {
+            continue;
+        }
+        if (n >= g_batch_count || resp.body.size() >= (size_t)g_batch_size) {
+            resp.headers["more"] = "1";
+            break;
+        }
+        st = db->get(ro, key, &value);
+        if (st.code() == ENOENT || (st.ok() && (!def->term(key, value, &t) || Slice(t) != et))) {
+            db->indexes_.stale_ ++;
+            st = Status();
+            continue;
+        } else if (!st.ok()) {
+            break;
+        }
+        Slice v(value);
+        addKvBody(key, &v, &resp.body);
+        resp.headers["last-term"] = et;
+        resp.headers["last-key"] = key;
+        n ++;
+    }
+    it.reset();
+    ldb->ReleaseSnapshot(ro.snapshot);
     if (!st.ok()) {
+        resp.body.clear();
         resp.setStatus(500, "Internal Error");
     }
 }
@@ -130,30 +353,125 @@ static void handleRangeGet(LogDb* db, HttpRequest& req, HttpResponse& resp) {
     Slice ekey = req.getArg("end");
     if (ekey.empty()) {
         ekey = "\xff";
+    } else if (ekey.compare(META_KEY_PREFIX) > 0) {
+        ekey = META_KEY_PREFIX;
     }
     bool inc = req.getArg("inc") == "1";
-    leveldb::Iterator* it = ldb->NewIterator(leveldb::ReadOptions());
-    unique_ptr<leveldb::Iterator> rel1(it);
-    int n = 0;
+    bool sync = req.getHeader("req-info").size(); //slaves get stored values with versions and deleted marks
+    KeyFilter filter;
+    if (sync && !filter.parse(req.getArg("filter"))) {
+        resp.setStatus(400, "bad filter");
+        return;
+    }
+    string token = req.getArg("token");
+    ScanSession* ss = NULL;
+    leveldb::Iterator* it = NULL;
+    unique_ptr<leveldb::Iterator> rel1;
     leveldb::Slice lekey = convSlice(ekey);
     leveldb::Slice lbkey = convSlice(bkey);
-    it->Seek(lbkey);
-    if (!inc && it->Valid() && it->key() == lbkey) {
-        it->Next();
+    if (token.size()) { //next page of a scan session
+        ss = db->scans_.take(token);
+        if (ss == NULL) {
+            resp.setStatus(410, "scan token expired");
+            return;
+        }
+        it = ss->it;
+        lekey = ss->ekey;
+    } else {
+        if (req.getArg("scan") == "1" && !sync) {
+            ss = db->scans_.create(ldb);
+            if (ss == NULL) {
+                resp.setStatus(503, "too many scan sessions");
+                resp.headers["Retry-After"] = "1";
+                return;
+            }
+            ss->ekey = ekey;
+            it = ss->it;
+        } else {
+            if (sync) { //taken before the iterator, slaves repairing with the page know which binlog it includes
+                string pos = db->appliedPosLock();
+                if (pos.size()) {
+                    resp.headers["binlog-pos"] = pos;
+                }
+            }
+            it = ldb->NewIterator(leveldb::ReadOptions());
+            rel1.reset(it);
+        }
+        it->Seek(lbkey);
+        if (!inc && it->Valid() && it->key() == lbkey) {
+            it->Next();
+        }
     }
+    int n = 0;
+    bool more = false;
     Slice k1;
-    for (; it->Valid(); it->Next()) {
+    string blob;
+    Status vs;
+    string skipTo; //keys not matching filter of slave are skipped by seeking to the next window
+    static thread_local size_t lastSize = 0;
+    reserveBody(&resp.body, lastSize);
+    for (; it->Valid(); skipTo.empty() ? it->Next() : it->Seek(skipTo)) {
+        skipTo.clear();
         if (it->key().compare(lekey) >= 0) {
             break;
         }
+        if (!filter.match(convSlice(it->key()))) {
+            if (!filter.next(convSlice(it->key()), &skipTo)) {
+                break;
+            }
+            continue;
+        }
         k1 = convSlice(it->key());
-        Slice v = convSlice(it->value());
+        Slice v;
+        vs = sync ? db->rawValue(convSlice(it->value()), &v, &blob)
+            : db->resolveValue(convSlice(it->value()), &v, &blob);
+        if (vs.code() == ENOENT) {
+            vs = Status();
+            continue;
+        } else if (!vs.ok()) {
+            break;
+        }
         addKvBody(k1, &v, &resp.body);
         if (++n >= g_batch_count || resp.body.size() >= (size_t)g_batch_size) {
+            more = true;
             break;
         }
     }
-    addBinlogHeader(bkey, k1, req, resp);
+    lastSize = resp.body.size();
+    if (!vs.ok()) {
+        if (ss) {
+            db->scans_.release(ss);
+        }
+        resp.body.clear();
+        resp.setStatus(500, "Internal Error");
+        return;
+    }
+    if (ss) {
+        if (more) {
+            it->Next();
+        }
+        if (more && it->Valid() && it->key().compare(lekey) < 0) {
+            resp.headers["scan-token"] = db->scans_.put(ss, token);
+        } else {
+            db->scans_.release(ss);
+        }
+    }
+    addBinlogHeader(db, bkey, k1, req, resp);
+}
+
+//hashes of [begin, end) split into parts, for slaves checking their data against this db
+static void handleRangeHash(LogDb* db, HttpRequest& req, HttpResponse& resp) {
+    string bkey = Slice(req.uri).sub(strlen("/range-hash/"));
+    int parts = util::atoi(req.getArg("parts").c_str());
+    parts = min(max(parts, 1), 256);
+    vector<RangeHash> ranges;
+    Status st = hashRange(db, bkey, req.getArg("end"), parts, &ranges);
+    if (!st.ok()) {
+        error("range hash failed %s", st.toString().c_str());
+        resp.setStatus(500, "Internal Error");
+        return;
+    }
+    encodeRangeHashes(ranges, &resp.body);
 }
 
 int64_t getSize(Slice bkey, Slice ekey, leveldb::DB* db) {
@@ -165,7 +483,8 @@ int64_t getSize(Slice bkey, Slice ekey, leveldb::DB* db) {
     return (int64_t)sz;
 }
 
-static void handleNav(leveldb::DB* db, HttpRequest& req, HttpResponse& resp) {
+static void handleNav(LogDb* ldb, HttpRequest& req, HttpResponse& resp) {
+    leveldb::DB* db = ldb->getdb();
     Slice uri = req.uri;
     Slice navn = "/nav-next/";
     Slice navp = "/nav-prev/";
@@ -174,6 +493,7 @@ static void handleNav(leveldb::DB* db, HttpRequest& req, HttpResponse& resp) {
     leveldb::Iterator* it = db->NewIterator(leveldb::ReadOptions());
     unique_ptr<leveldb::Iterator> rel1(it);
     string ln;
+    Slice v;
     resp.body.append("<a href=\"/nav-next/\">first-page</a></br>");
     if (uri.starts_with(navn)){
         Slice pgkey = uri.sub(navn.size());
@@ -181,7 +501,14 @@ static void handleNav(leveldb::DB* db, HttpRequest& req, HttpResponse& resp) {
             (int)pgkey.size(), pgkey.data());
         resp.body.append(ln);
         Slice key = pgkey;
+        //pages seek again instead of keeping a scan session, abandoned pages would hold sessions until scan_ttl
         for (it->Seek(convSlice(pgkey)); it->Valid(); it->Next()) {
+            if (isMetaKey(convSlice(it->key()))) {
+                break;
+            }
+            if (!LogDb::decodeValue(convSlice(it->value()), &v)) {
+                continue;
+            }
             key = convSlice(it->key());
             ln = util::format("<a href=\"%.*s?d=%.*s\">delete</a> <a href=\"/d/%.*s\">%.*s</a></br>",
                 (int)uri.size(), uri.data(), (int)key.size(), key.data(),
@@ -202,6 +529,9 @@ static void handleNav(leveldb::DB* db, HttpRequest& req, HttpResponse& resp) {
         lns.push_back(ln);
         Slice key = pgkey;
         for (it->Seek(convSlice(pgkey)); it->Valid(); it->Prev()) {
+            if (!LogDb::decodeValue(convSlice(it->value()), &v)) {
+                continue;
+            }
             key = convSlice(it->key());
             ln = util::format("<a href=\"%.*s?d=%.*s\">delete</a> <a href=\"/d/%.*s\">%.*s</a></br>",
                 (int)uri.size(), uri.data(), (int)key.size(), key.data(),
@@ -220,7 +550,16 @@ static void handleNav(leveldb::DB* db, HttpRequest& req, HttpResponse& resp) {
     } else if (uri == navl) {
         Slice key;
         vector<string> lns;
-        for (it->SeekToLast(); it->Valid(); it->Prev()) {
+        it->Seek(META_KEY_PREFIX); //last user key is right before the server indexes
+        if (it->Valid()) {
+            it->Prev();
+        } else {
+            it->SeekToLast();
+        }
+        for (; it->Valid(); it->Prev()) {
+            if (!LogDb::decodeValue(convSlice(it->value()), &v)) {
+                continue;
+            }
             key = convSlice(it->key());
             if (lns.empty()) {
                 ln = util::format("<a href=\"/nav-next/%.*s\">next-page</a></br>",
@@ -260,32 +599,161 @@ static void handleSize(leveldb::DB* db, HttpRequest& req, HttpResponse& resp) {
     resp.body = util::format("%ld", sz);
 }
 
+void addReqTask(EventBase* base, ThreadPool& pool, LogDb* db, bool write, const Task& task, const function<void(const char*)>& reject) {
+    atomic<int64_t>& queued = write ? g_admission.writeQueued : g_admission.readQueued;
+    int limit = write ? g_write_queue_limit : g_read_queue_limit;
+    if (write && g_level0_stop > 0 && db->level0_ >= g_level0_stop) {
+        g_admission.level0Rejects ++;
+        reject("too many level0 files");
+        return;
+    }
+    if (limit > 0 && queued >= limit) {
+        g_admission.queueRejects ++;
+        reject("queue full");
+        return;
+    }
+    queued ++;
+    int64_t enqueued = util::timeMilli();
+    ThreadPool* p = &pool;
+    auto enqueue = [=, &queued] {
+        p->addTask([=, &queued] {
+            queued --;
+            if (g_queue_wait > 0 && util::timeMilli() - enqueued > g_queue_wait) {
+                g_admission.waitRejects ++;
+                reject("queue wait too long");
+                return;
+            }
+            task();
+        });
+    };
+    //writes are delayed in the loop, the write thread also applies binlog of masters and runs the sweepers
+    int delay = write ? db->writeDelay() : 0;
+    if (delay > 0) {
+        base->runAfter(delay, enqueue);
+    } else {
+        enqueue();
+    }
+}
+
+//send the response with value as body. header and value go to the socket in one writev straight from value,
+//the header part the socket does not take goes to the output buffer, the rest of value is kept in the context
+//of the connection and written by sendPendingValue. called in the loop thread of con
+static void sendValue(const HttpConnPtr& con, const shared_ptr<string>& value) {
+    HttpRequest& req = con.getRequest();
+    HttpResponse& resp = con.getResponse();
+    string head = util::format("%s %d %s\r\n", req.version.size() ? req.version.c_str() : "HTTP/1.1",
+        resp.status, resp.statusWord.c_str());
+    for (auto& hd: resp.headers) {
+        head += hd.first + ": " + hd.second + "\r\n";
+    }
+    head += util::format("Connection: Keep-Alive\r\nContent-Length: %lu\r\n\r\n", value->size());
+    TcpConnPtr tcp = con;
+    Buffer& out = tcp->getOutput();
+    size_t w = 0;
+    if (tcp->getChannel() && out.empty() && !tcp->writable()) {
+        struct iovec iov[2] = {
+            { (void*)head.data(), head.size() },
+            { (void*)value->data(), value->size() },
+        };
+        ssize_t r = ::writev(tcp->getChannel()->fd(), iov, 2);
+        w = r > 0 ? r : 0; //errors show up again on the next write
+    }
+    if (w < head.size()) {
+        out.append(head.data() + w, head.size() - w);
+        w = head.size();
+    }
+    con.clearData();
+    HttpConnState& cs = tcp->context<HttpConnState>();
+    if (w - head.size() < value->size() && tcp->getChannel()) {
+        cs.value = value;
+        cs.sent = w - head.size();
+        tcp->getChannel()->enableReadWrite(false, true); //requests pipelined after it wait until it is sent
+    }
+    tcp->sendOutput();
+}
+
+bool sendPendingValue(const TcpConnPtr& tcp) {
+    HttpConnState& cs = tcp->context<HttpConnState>();
+    if (!cs.value || tcp->getState() != TcpConn::Connected || !tcp->getChannel() || !tcp->getOutput().empty()) {
+        return false;
+    }
+    const string& v = *cs.value;
+    while (cs.sent < v.size()) {
+        ssize_t r = ::write(tcp->getChannel()->fd(), v.data() + cs.sent, v.size() - cs.sent);
+        if (r > 0) {
+            cs.sent += r;
+        } else if (r < 0 && errno == EINTR) {
+            continue;
+        } else if (r < 0 && errno == EAGAIN) {
+            //the caller turns write events off when the output buffer is empty, so they are turned on again after it
+            tcp->getBase()->safeCall([tcp] {
+                if (tcp->context<HttpConnState>().value && tcp->getChannel()) {
+                    tcp->getChannel()->enableWrite(true);
+                }
+            });
+            return false;
+        } else {
+            error("send value to %s failed %d %s", tcp->str().c_str(), errno, strerror(errno));
+            cs.value.reset();
+            tcp->close();
+            return false;
+        }
+    }
+    cs.value.reset();
+    cs.sent = 0;
+    tcp->getChannel()->enableRead(true);
+    return true;
+}
+
 void handleReq(EventBase& base, LogDb* db, const HttpConnPtr& con) {
     HttpRequest& req = con.getRequest();
+    AllocStats::instance().addRequest();
     Status mst;
     HttpResponse& resp = con.getResponse();
     Slice uri = req.uri;
     Slice d = "/d/";
-    string value;
     leveldb::DB* ldb = db->getdb();
     if (uri.starts_with(d)) {
         Slice localkey = uri.sub(d.size());
+        int ks = 0;
+        const char* slash = (const char*)memchr(localkey.data(), '/', localkey.size());
+        Keyspace* kspace = slash ? db->keyspaces_.byName(Slice(localkey.begin(), slash)) : NULL;
+        if (kspace) { //keys of other keyspaces are /d/<name>/<key>
+            ks = kspace->id;
+            localkey = Slice(slash + 1, localkey.end());
+        }
         leveldb::Slice key = convSlice(localkey);
         if (key.empty()) {
             resp.setStatus(403, "empty key");
+        } else if (isMetaKey(localkey)) {
+            resp.setStatus(403, "reserved key");
         } else if (req.method == "GET") {
-            leveldb::Status s = ldb->Get(leveldb::ReadOptions(), key, &value);
+            Status s = Status::fromFormat(EAGAIN, "min-pos not reached");
+            shared_ptr<string> value(new string); //kept alive until sent
+            if (waitMinPos(db, req, resp)) {
+                s = db->get(leveldb::ReadOptions(), localkey, value.get(), ks);
+            }
             if (s.ok()) {
-                resp.body2 = value;
-            } else if (s.IsNotFound()) {
+                db->hotKeys_.onRead(localkey, localkey.size() + value->size(), ks);
+                accesslog("req %s processed status %d length %lu",
+                    req.query_uri.c_str(), resp.status, value->size());
+                base.safeCall([con, value]{ sendValue(con, value); adebug("resp sended");});
+                return;
+            } else if (s.code() == ENOENT) {
                 resp.setNotFound();
-            } else {
-                mst = (ConvertStatus)s;
+            } else if (s.code() != EAGAIN) {
+                mst = s;
             }
         } else if (req.method == "POST") {
-            mst = db->write(localkey, req.getBody());
+            mst = db->write(localkey, req.getBody(), getExpire(req), ks);
+            if (mst.ok()) {
+                addPosHeader(db, resp);
+            }
         } else if (req.method == "DELETE") {
-            mst = db->remove(localkey);
+            mst = db->remove(localkey, ks);
+            if (mst.ok()) {
+                addPosHeader(db, resp);
+            }
         } else {
             resp.setStatus(403, "unknown method");
         }
@@ -302,26 +770,45 @@ void handleReq(EventBase& base, LogDb* db, const HttpConnPtr& con) {
         if (!mst.ok()) {
             resp.setStatus(500, "Internal Error");
         } else {
-            handleNav(ldb, req, resp);
+            handleNav(db, req, resp);
         }
     } else if (uri.starts_with("/batch-get/")) {
-        handleBatchGet(db, req, resp);
+        if (waitMinPos(db, req, resp)) {
+            handleBatchGet(db, req, resp);
+        }
     } else if (uri.starts_with("/batch-set/")) {
         handleBatchSet(db, req, resp);
     } else if (uri.starts_with("/batch-delete/")) {
         handleBatchDelete(db, req, resp);
     } else if (uri.starts_with("/range-get/")){
-        handleRangeGet(db, req, resp);
+        if (waitMinPos(db, req, resp)) {
+            handleRangeGet(db, req, resp);
+        }
+    } else if (uri.starts_with("/index-get/")) {
+        if (waitMinPos(db, req, resp)) {
+            handleIndexGet(db, req, resp);
+        }
+    } else if (uri.starts_with("/range-hash/")) {
+        handleRangeHash(db, req, resp);
+    } else if (uri.starts_with("/incr/")) {
+        handleModify(db, "incr", uri.sub(6), req, resp);
+    } else if (uri.starts_with("/cas/")) {
+        handleModify(db, "cas", uri.sub(5), req, resp);
+    } else if (uri.starts_with("/append/")) {
+        handleModify(db, "append", uri.sub(8), req, resp);
     } else if (uri.starts_with("/size/")) {
         handleSize(ldb, req, resp);
     } else if (uri.starts_with("/binlog/")) {
         handleBinlog(db, &base, con);
         return;
+    } else if (uri.starts_with("/cdc/")) {
+        handleCdc(db, &base, con);
+        return;
     } else {
         resp.setNotFound();
     }
-    info("req %s processed status %d length %lu",
+    accesslog("req %s processed status %d length %lu",
         req.query_uri.c_str(), resp.status, resp.getBody().size());
-    base.safeCall([con]{ con.sendResponse(); info("resp sended");});
+    base.safeCall([con]{ con.sendResponse(); adebug("resp sended");});
 }
 
@@ -2,6 +2,7 @@
 #include <handy/handy.h>
 #include <handy/http.h>
 #include <handy/conf.h>
+#include <handy/threads.h>
 #include "leveldb/db.h"
 #include "globals.h"
 #include "logdb.h"
@@ -12,4 +13,18 @@ using namespace handy;
 int64_t getSize(Slice bkey, Slice ekey, leveldb::DB* db);
 
 void handleReq(EventBase& base, LogDb* db, const HttpConnPtr& con);
+//run a client request in pool, or call reject with the reason if the server is overloaded. called in the loop thread of base,
+//writes are queued after a delay when level0 files pile up. reject is called in pool thread when the request waited too long in queue
+void addReqTask(EventBase* base, ThreadPool& pool, LogDb* db, bool write, const Task& task, const function<void(const char*)>& reject);
+//write callback of leveldbd http connections, writes the rest of a value sendValue started.
+//true when the whole value is sent and the requests waiting in input should be read
+bool sendPendingValue(const TcpConnPtr& tcp);
+void addKvBody(Slice key, const Slice* value, string* body);
 Status decodeKvBody(Slice* body, Slice* key, Slice* value, bool* exist );
+//apply records of a kv-format body one by one, value len -1 deletes the key. EPERM for a reserved key,
+//checked before any record is applied. n counts records applied
+Status applyBatchSet(LogDb* db, Slice body, time_t expire, int64_t* n);
+//delete keys of a key-format body, EPERM for a reserved key as in applyBatchSet
+Status applyBatchDelete(LogDb* db, Slice body, int64_t* n);
+//query ttl is seconds the written keys live, def is returned if ttl is absent
+time_t getExpire(HttpRequest& req, time_t def=0);
@@ -0,0 +1,120 @@
+#include "hot-keys.h"
+#include "globals.h"
+#include <algorithm>
+
+//keys may be binary, unprintable bytes are shown as \xNN
+static string printable(const string& key) {
+    string r;
+    for (unsigned char c: key) {
+        if (c >= 0x20 && c < 0x7f && c != '\\') {
+            r.push_back(c);
+        } else {
+            r.append(util::format("\\x%02x", c));
+        }
+    }
+    return r;
+}
+
+void KeySketch::init(int width, int top) {
+    width_ = max(width, 64);
+    top_ = max(top, 1);
+    counts_.assign(DEPTH * width_, 0);
+}
+
+void KeySketch::add(Slice key, int64_t bytes) {
+    uint64_t h = fnv1a(key);
+    uint32_t h1 = h, h2 = (h >> 32) | 1;
+    lock_guard<mutex> lk(mu_);
+    int64_t est = INT64_MAX;
+    for (int i = 0; i < DEPTH; i ++) {
+        uint32_t& c = counts_[i * width_ + (h1 + i * h2) % width_];
+        if (c < UINT32_MAX) {
+            c ++;
+        }
+        est = min(est, (int64_t)c);
+    }
+    string k = key;
+    auto it = heavy_.find(k);
+    if (it != heavy_.end()) {
+        it->second.count = est;
+        it->second.bytes += bytes;
+        return;
+    }
+    if ((int)heavy_.size() >= 2 * top_) {
+        if (est <= minCount_) {
+            return;
+        }
+        auto mi = min_element(heavy_.begin(), heavy_.end(), [](const pair<const string, Entry>& a, const pair<const string, Entry>& b) {
+            return a.second.count < b.second.count;
+        });
+        heavy_.erase(mi);
+    }
+    //bytes before the key became a candidate are estimated from this one
+    heavy_[k] = Entry{est, bytes * est};
+    updateMin_();
+}
+
+void KeySketch::updateMin_() {
+    minCount_ = 0;
+    if ((int)heavy_.size() < 2 * top_) {
+        return;
+    }
+    minCount_ = INT64_MAX;
+    for (auto& kv: heavy_) {
+        minCount_ = min(minCount_, kv.second.count);
+    }
+}
+
+void KeySketch::decay() {
+    lock_guard<mutex> lk(mu_);
+    for (auto& c: counts_) {
+        c /= 2;
+    }
+    for (auto it = heavy_.begin(); it != heavy_.end(); ) {
+        it->second.count /= 2;
+        it->second.bytes /= 2;
+        if (it->second.count == 0) {
+            it = heavy_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    updateMin_();
+}
+
+string KeySketch::report(int scale) {
+    vector<pair<string, Entry>> tops;
+    {
+        lock_guard<mutex> lk(mu_);
+        tops.assign(heavy_.begin(), heavy_.end());
+    }
+    sort(tops.begin(), tops.end(), [](const pair<string, Entry>& a, const pair<string, Entry>& b) {
+        return a.second.count > b.second.count;
+    });
+    string r;
+    for (size_t i = 0; i < tops.size() && (int)i < top_; i ++) {
+        r += util::format("%s %ld %ld\n", printable(tops[i].first).c_str(),
+            (long)(tops[i].second.count * scale), (long)(tops[i].second.bytes * scale));
+    }
+    return r;
+}
+
+void HotKeys::init(Conf& conf) {
+    sample_ = conf.getInteger("", "hotkey_sample", 16);
+    decayInterval_ = max(1L, conf.getInteger("", "hotkey_decay", 60));
+    delimiters_ = conf.get("", "hotkey_delimiters", ":/_");
+    int width = conf.getInteger("", "hotkey_width", 4096);
+    int top = conf.getInteger("", "hotkey_top", 20);
+    reads_.init(width, top);
+    writes_.init(width, top);
+    prefixes_.init(width, top);
+}
+
+Slice HotKeys::prefixOf(Slice key) {
+    for (size_t i = 0; i < key.size(); i ++) {
+        if (delimiters_.find(key[i]) != string::npos) {
+            return Slice(key.data(), i + 1);
+        }
+    }
+    return Slice(key.data(), min(key.size(), (size_t)8));
+}
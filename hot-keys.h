@@ -0,0 +1,70 @@
+#pragma once
+#include <handy/handy.h>
+#include <handy/conf.h>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "warmup.h"
+
+using namespace std;
+using namespace handy;
+
+//count-min sketch of key counts with the heavy hitters kept beside it.
+//a key enters the candidates when its estimated count passes the smallest candidate
+struct KeySketch {
+    static const int DEPTH = 4;
+    struct Entry {
+        int64_t count, bytes;
+    };
+    KeySketch(): width_(0), top_(0), minCount_(0) {}
+    void init(int width, int top);
+    void add(Slice key, int64_t bytes);
+    //halve all counts, so old traffic fades away
+    void decay();
+    //top keys by count as lines of 'key count bytes', counts and bytes multiplied by scale
+    string report(int scale);
+
+    mutex mu_;
+    int width_, top_;
+    vector<uint32_t> counts_; //DEPTH rows of width_
+    unordered_map<string, Entry> heavy_; //at most 2*top_ candidates
+    int64_t minCount_; //smallest count in heavy_ when it is full, 0 otherwise
+
+    void updateMin_();
+};
+
+//hot keys and key prefixes of reads and writes. 1 of sample operations is counted
+struct HotKeys {
+    HotKeys(): sample_(0), decayInterval_(60), warm_(NULL) {}
+    void init(Conf& conf);
+    bool enabled() { return sample_ > 0; }
+    bool sampled() {
+        thread_local uint64_t n = 0;
+        return sample_ > 0 && ++n % sample_ == 0;
+    }
+    //called for keys found by reads, misses are not counted. ks is the keyspace of key
+    void onRead(Slice key, size_t bytes, int ks=0) {
+        if (sampled()) {
+            reads_.add(key, bytes);
+            prefixes_.add(prefixOf(key), bytes);
+            if (warm_ && ks == 0) { //warm up reads the default keyspace only
+                warm_->add(key);
+            }
+        }
+    }
+    void onWrite(Slice key, size_t bytes) {
+        if (sampled()) {
+            writes_.add(key, bytes);
+            prefixes_.add(prefixOf(key), bytes);
+        }
+    }
+    //key up to and including the first delimiter, or the first 8 bytes if there is none
+    Slice prefixOf(Slice key);
+    void decay() { reads_.decay(); writes_.decay(); prefixes_.decay(); }
+
+    int sample_;
+    int decayInterval_; //seconds
+    string delimiters_;
+    KeySketch reads_, writes_, prefixes_;
+    Warmup* warm_; //sampled reads also go to it when set
+};
@@ -0,0 +1,165 @@
+#include "ingest.h"
+#include "handler.h"
+#include "async-log.h"
+
+//length of the complete records at the beginning of data
+static size_t completeRecords(Slice data, bool kv) {
+    const char* p = data.begin();
+    const char* done = p;
+    while (p < data.end()) {
+        const char* e = (const char*)memchr(p, '\n', data.end() - p);
+        if (e == NULL) {
+            break;
+        }
+        if (kv) {
+            const char* e2 = (const char*)memchr(e + 1, '\n', data.end() - e - 1);
+            if (e2 == NULL) {
+                break;
+            }
+            int64_t len = util::atoi(e + 1, e2);
+            if (data.end() - e2 < 2 + max(len, (int64_t)0)) {
+                break;
+            }
+            e = e2 + 1 + max(len, (int64_t)0);
+        }
+        p = done = e + 1;
+    }
+    return done - data.begin();
+}
+
+//queue the complete records of pending, or all of it at the end of body
+static void queueChunk(const TcpConnPtr& tcp, LogDb* db, ThreadPool* wpool, const HttpCallBack& cb) {
+    Ingest& ig = tcp->context<HttpConnState>().ingest;
+    size_t len = ig.remain ? completeRecords(ig.pending, ig.kv) : ig.pending.size();
+    if (ig.err.size()) {
+        ig.pending.clear();
+        return;
+    }
+    if (len == 0) {
+        return;
+    }
+    shared_ptr<string> chunk(new string(ig.pending, 0, len));
+    ig.pending.erase(0, len);
+    ig.inflight ++;
+    bool kv = ig.kv;
+    time_t expire = ig.expire;
+    //called in the write pool, or in the loop when the chunk is rejected
+    auto done = [=](int64_t n, const string& err, int code) {
+        tcp->getBase()->safeCall([=] {
+            Ingest& ig = tcp->context<HttpConnState>().ingest;
+            ig.inflight --;
+            ig.records += n;
+            if (err.size() && ig.err.empty()) {
+                ig.err = err;
+                ig.code = code;
+            }
+            if (tcp->getState() != TcpConn::Connected) {
+                return;
+            }
+            if (tcp->getChannel() && !tcp->getChannel()->readEnabled()) {
+                tcp->getChannel()->enableRead(true);
+            }
+            onHttpRead(tcp, db, wpool, cb);
+        });
+    };
+    //each chunk is admitted as a write request, a rejected one fails the rest of the stream with 503
+    addReqTask(tcp->getBase(), *wpool, db, true, [=] {
+        int64_t n = 0;
+        Status st = kv ? applyBatchSet(db, *chunk, expire, &n) : applyBatchDelete(db, *chunk, &n);
+        done(n, st.ok() ? "" : st.toString(), st.code() == EPERM ? 403 : 500);
+    }, [=](const char* reason) {
+        done(0, reason, 503);
+    });
+}
+
+static void finishIngest(const TcpConnPtr& tcp, LogDb* db) {
+    Ingest& ig = tcp->context<HttpConnState>().ingest;
+    HttpConnPtr con = tcp;
+    HttpRequest& req = con.getRequest();
+    HttpResponse& resp = con.getResponse();
+    if (ig.err.size()) {
+        error("streamed %s failed after %ld records: %s", req.uri.c_str(), (long)ig.records, ig.err.c_str());
+        if (ig.code == 503) {
+            resp.setStatus(503, "Service Unavailable");
+            resp.headers["Retry-After"] = "1";
+        } else {
+            resp.setStatus(ig.code, ig.code == 403 ? "reserved key" : "Internal Error");
+        }
+    } else {
+        string pos = db->binlogPos();
+        if (pos.size()) {
+            resp.headers["binlog-pos"] = pos;
+        }
+    }
+    resp.headers["records"] = util::format("%ld", (long)ig.records);
+    accesslog("req %s streamed records %ld status %d", req.query_uri.c_str(), (long)ig.records, resp.status);
+    //the body is consumed already, so the request is cleared here instead of by HttpConnPtr::clearData
+    resp.encode(tcp->getOutput());
+    req.clear();
+    resp.clear();
+    ig = Ingest();
+    tcp->sendOutput();
+}
+
+void onHttpRead(const TcpConnPtr& tcp, LogDb* db, ThreadPool* wpool, const HttpCallBack& cb) {
+    HttpConnPtr con = tcp;
+    if (tcp->context<HttpConnState>().value) { //responses go out in order, read again when the value is sent
+        if (tcp->getChannel() && tcp->getChannel()->readEnabled()) {
+            tcp->getChannel()->enableRead(false);
+        }
+        return;
+    }
+    Ingest& ig = tcp->context<HttpConnState>().ingest;
+    Buffer& input = tcp->getInput();
+    if (!ig.active) {
+        HttpRequest& req = con.getRequest();
+        HttpMsg::Result r = req.tryDecode(input);
+        if (r == HttpMsg::Error) {
+            tcp->close();
+            return;
+        } else if (r == HttpMsg::Complete) {
+            cb(con);
+            return;
+        }
+        bool batch = Slice(req.uri).starts_with("/batch-set/") || Slice(req.uri).starts_with("/batch-delete/");
+        size_t clen = util::atoi(req.getHeader("content-length").c_str());
+        if (!batch || req.method == "GET" || g_ingest_chunk <= 0 || clen <= (size_t)g_ingest_chunk) {
+            if (r == HttpMsg::Continue100) {
+                tcp->send("HTTP/1.1 100 Continue\r\n\r\n");
+            }
+            return;
+        }
+        //header is parsed, the body is taken from input as it arrives
+        ig.active = true;
+        ig.kv = Slice(req.uri).starts_with("/batch-set/");
+        ig.expire = getExpire(req);
+        ig.remain = clen;
+        input.consume(req.getByte());
+        if (r == HttpMsg::Continue100) {
+            tcp->send("HTTP/1.1 100 Continue\r\n\r\n");
+        }
+    }
+    size_t n = min(input.size(), ig.remain);
+    ig.pending.append(input.data(), n);
+    input.consume(n);
+    ig.remain -= n;
+    while (ig.inflight < 2 && (ig.pending.size() >= (size_t)g_ingest_chunk || (ig.remain == 0 && ig.pending.size()))) {
+        size_t before = ig.pending.size();
+        queueChunk(tcp, db, wpool, cb);
+        if (ig.pending.size() == before) { //a record larger than a chunk, wait for the rest of it
+            break;
+        }
+    }
+    if (ig.remain == 0 && ig.pending.empty() && ig.inflight == 0) {
+        finishIngest(tcp, db);
+        if (input.size()) { //next pipelined request
+            onHttpRead(tcp, db, wpool, cb);
+        }
+        return;
+    }
+    //stop reading until a chunk is applied, the socket buffer holds the sender back
+    bool full = ig.inflight >= 2 && ig.pending.size() >= (size_t)g_ingest_chunk;
+    if (tcp->getChannel() && tcp->getChannel()->readEnabled() == full) {
+        tcp->getChannel()->enableRead(!full);
+    }
+}
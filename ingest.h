@@ -0,0 +1,36 @@
+#pragma once
+#include <handy/handy.h>
+#include <handy/http.h>
+#include <handy/threads.h>
+#include "logdb.h"
+
+using namespace std;
+using namespace handy;
+
+//state of a streamed batch body
+struct Ingest {
+    bool active;
+    bool kv; //batch-set, or keys of batch-delete
+    time_t expire;
+    size_t remain; //body bytes not received yet
+    string pending; //body bytes received but not queued
+    int inflight; //chunks queued in write pool
+    int64_t records;
+    string err; //first error, the rest of the body is read and dropped
+    int code;
+    Ingest(): active(false), kv(true), expire(0), remain(0), inflight(0), records(0), code(200) {}
+};
+
+//state of a leveldbd http connection, kept in its context
+struct HttpConnState {
+    Ingest ingest;
+    shared_ptr<string> value; //body of a response written straight from the value, see sendValue
+    size_t sent; //bytes of value written
+    HttpConnState(): sent(0) {}
+};
+
+//read callback of leveldbd http connections, set in place of HttpServer's.
+//batch-set and batch-delete bodies larger than ingest_chunk are applied chunk by chunk while they arrive,
+//with at most 2 chunks queued in the write pool, each admitted like a write request.
+//other requests are passed to cb when complete
+void onHttpRead(const TcpConnPtr& tcp, LogDb* db, ThreadPool* wpool, const HttpCallBack& cb);
@@ -0,0 +1,76 @@
+#include "key-filter.h"
+#include <algorithm>
+
+//smallest key larger than all keys with the prefix, empty if there is none
+static string prefixEnd(string prefix) {
+    while (prefix.size() && (unsigned char)prefix.back() == 0xff) {
+        prefix.pop_back();
+    }
+    if (prefix.size()) {
+        prefix.back() ++;
+    }
+    return prefix;
+}
+
+bool KeyFilter::parse(const string& spec1) {
+    spec = spec1;
+    windows.clear();
+    for (auto& item: Slice(spec).split(',')) {
+        Slice it = item.trimSpace();
+        if (it.empty()) {
+            continue;
+        }
+        if (it.end()[-1] == '*') {
+            string p(it.begin(), it.end() - 1);
+            windows.push_back(make_pair(p, prefixEnd(p)));
+            continue;
+        }
+        const char* t = (const char*)memchr(it.data(), '~', it.size());
+        if (t == NULL) {
+            return false;
+        }
+        windows.push_back(make_pair(string(it.begin(), t), string(t + 1, it.end())));
+        if (windows.back().second.size() && windows.back().second <= windows.back().first) {
+            return false;
+        }
+    }
+    sort(windows.begin(), windows.end());
+    //merge overlapping windows
+    vector<pair<string, string>> merged;
+    for (auto& w: windows) {
+        if (merged.size() && (merged.back().second.empty() || w.first <= merged.back().second)) {
+            if (merged.back().second.size() && (w.second.empty() || w.second > merged.back().second)) {
+                merged.back().second = w.second;
+            }
+        } else {
+            merged.push_back(w);
+        }
+    }
+    windows.swap(merged);
+    return true;
+}
+
+bool KeyFilter::match(Slice key) const {
+    if (windows.empty()) {
+        return true;
+    }
+    auto it = upper_bound(windows.begin(), windows.end(), key, [](Slice k, const pair<string, string>& w) {
+        return k.compare(w.first) < 0;
+    });
+    if (it == windows.begin()) {
+        return false;
+    }
+    --it;
+    return it->second.empty() || key.compare(it->second) < 0;
+}
+
+bool KeyFilter::next(Slice key, string* begin) const {
+    auto it = upper_bound(windows.begin(), windows.end(), key, [](Slice k, const pair<string, string>& w) {
+        return k.compare(w.first) < 0;
+    });
+    if (it == windows.end()) {
+        return false;
+    }
+    *begin = it->first;
+    return true;
+}
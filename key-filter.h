@@ -0,0 +1,20 @@
+#pragma once
+#include <handy/slice.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace handy;
+
+//keys a slave replicates, as comma separated items: 'user:*' for a prefix, 'a~m' for range [a, m).
+//an empty filter matches every key
+struct KeyFilter {
+    //merged windows [begin, end) in key order, empty end for no limit
+    vector<pair<string, string>> windows;
+    string spec;
+    bool empty() const { return windows.empty(); }
+    bool parse(const string& spec);
+    bool match(Slice key) const;
+    //begin of the first window after key, false if there is none
+    bool next(Slice key, string* begin) const;
+};
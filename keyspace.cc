@@ -0,0 +1,67 @@
+#include "keyspace.h"
+#include <handy/file.h>
+#include <handy/logging.h>
+
+Status Keyspaces::open(Conf& conf, const string& dbdir) {
+    for (auto& item: Slice(conf.get("", "keyspaces", "")).split(',')) {
+        Slice it = item.trimSpace();
+        if (it.empty()) {
+            continue;
+        }
+        const char* c = (const char*)memchr(it.data(), ':', it.size());
+        string name = c ? string(it.begin(), c) : string();
+        int id = c ? util::atoi(c + 1, it.end()) : 0;
+        if (name.empty() || name.find('/') != string::npos || id <= 0 || id > 0x7fffff || byName_.count(name) || byId_.count(id)) {
+            return Status::fromFormat(EINVAL, "bad keyspace '%.*s', should be name:id with a unique positive id", (int)it.size(), it.data());
+        }
+        Keyspace* ks = new Keyspace;
+        ks->name = name;
+        ks->id = id;
+        byName_[name] = ks;
+        byId_[id] = ks;
+        leveldb::Options options;
+        options.create_if_missing = true;
+        options.write_buffer_size = conf.getInteger(name, "write_buffer", 4) * 1024 * 1024;
+        ks->cache = leveldb::NewLRUCache(conf.getInteger(name, "cache_size", 8) * 1024 * 1024);
+        options.block_cache = ks->cache;
+        int bloomBits = conf.getInteger(name, "bloom_bits", 0);
+        if (bloomBits > 0) {
+            ks->filter = leveldb::NewBloomFilterPolicy(bloomBits);
+            options.filter_policy = ks->filter;
+        }
+        options.compression = conf.getBoolean(name, "compression", true) ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+        Status st = (ConvertStatus)leveldb::DB::Open(options, dbdir+"ks-"+name, &ks->db);
+        info("open keyspace %s id %d %s", name.c_str(), id, st.toString().c_str());
+        if (!st.ok()) {
+            return st;
+        }
+    }
+    return Status();
+}
+
+Keyspace* Keyspaces::byName(Slice name) {
+    auto p = byName_.find(name.toString());
+    return p == byName_.end() ? NULL : p->second;
+}
+
+Keyspace* Keyspaces::byId(int id) {
+    auto p = byId_.find(id);
+    return p == byId_.end() ? NULL : p->second;
+}
+
+vector<Keyspace*> Keyspaces::all() {
+    vector<Keyspace*> r;
+    for (auto& p: byId_) {
+        r.push_back(p.second);
+    }
+    return r;
+}
+
+Keyspaces::~Keyspaces() {
+    for (auto& p: byId_) {
+        delete p.second->db;
+        delete p.second->cache;
+        delete p.second->filter;
+        delete p.second;
+    }
+}
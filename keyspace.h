@@ -0,0 +1,32 @@
+#pragma once
+#include <handy/conf.h>
+#include <handy/status.h>
+#include "leveldb/db.h"
+#include "leveldb/cache.h"
+#include "leveldb/filter_policy.h"
+#include "globals.h"
+
+//named keyspace with its own leveldb instance and options, addressed as /d/<name>/<key>.
+//id is carried in binlog records, 0 is the default keyspace which is LogDb::db_
+struct Keyspace {
+    string name;
+    int id;
+    leveldb::DB* db;
+    leveldb::Cache* cache;
+    const leveldb::FilterPolicy* filter;
+    Keyspace(): id(0), db(NULL), cache(NULL), filter(NULL) {}
+};
+
+//keyspaces configured as 'keyspaces = hot:1,archive:2', options of each in its section of leveldbd.conf
+struct Keyspaces {
+    Status open(Conf& conf, const string& dbdir);
+    bool empty() { return byName_.empty(); }
+    //NULL if not configured
+    Keyspace* byName(Slice name);
+    Keyspace* byId(int id);
+    vector<Keyspace*> all();
+    ~Keyspaces();
+
+    map<string, Keyspace*> byName_;
+    map<int, Keyspace*> byId_;
+};
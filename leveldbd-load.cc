@@ -0,0 +1,326 @@
+#include <handy/threads.h>
+#include <handy/status.h>
+#include <handy/file.h>
+#include <handy/logging.h>
+#include <algorithm>
+#include <condition_variable>
+#include <queue>
+#include <stdio.h>
+#include "globals.h"
+#include "logdb.h"
+
+//offline bulk loader. input is sorted externally in parallel runs, then merged into a new leveldb in key order.
+//sorted writes let leveldb place flushed tables without overlap, so compaction mostly moves files instead of rewriting
+
+const char* usage = "usage: %s [-d dbdir] [-t kv|bin] [-m memory_mb] [-j threads] [-s host:port:fileno:offset] <input>...\n"
+    "  -t input format, kv is the kv-format of batch-set, bin is records of 'keylen(4) valuelen(4) key value'\n"
+    "  -s write slave-status to follow the master from binlog fileno/offset\n";
+
+struct LoadOptions {
+    string dbdir, format, slave;
+    int64_t memory;
+    int threads;
+    vector<string> inputs;
+    LoadOptions(): dbdir("ldbd"), format("kv"), memory(1024*1024*1024), threads(4) {}
+};
+
+//parse one record at p, returns bytes consumed, 0 if incomplete, -1 on bad format
+static int64_t parseBin(const char* p, const char* pe, Slice* key, Slice* value) {
+    if (pe - p < 8) {
+        return 0;
+    }
+    int32_t klen = *(int32_t*)p, vlen = *(int32_t*)(p+4);
+    if (klen <= 0 || vlen < 0) {
+        return -1;
+    }
+    if (pe - p < 8 + klen + vlen) {
+        return 0;
+    }
+    *key = Slice(p+8, klen);
+    *value = Slice(p+8+klen, vlen);
+    return 8 + klen + vlen;
+}
+
+static int64_t parseKv(const char* p, const char* pe, Slice* key, Slice* value) {
+    const char* k = (const char*)memchr(p, '\n', pe - p);
+    if (k == NULL) {
+        return 0;
+    }
+    const char* l = (const char*)memchr(k+1, '\n', pe - k - 1);
+    if (l == NULL) {
+        return 0;
+    }
+    int64_t len = util::atoi(k+1, l);
+    if (len < 0 || k == p) {
+        return -1;
+    }
+    if (pe - l - 1 < len + 1) {
+        return 0;
+    }
+    *key = Slice(p, k);
+    *value = Slice(l+1, len);
+    return l + 1 + len + 1 - p;
+}
+
+static void writeBin(FILE* fp, Slice key, Slice value) {
+    int32_t head[2] = { (int32_t)key.size(), (int32_t)value.size() };
+    fwrite(head, sizeof head, 1, fp);
+    fwrite(key.data(), key.size(), 1, fp);
+    fwrite(value.data(), value.size(), 1, fp);
+}
+
+typedef pair<Slice, Slice> KvSlice;
+
+struct SortRun {
+    shared_ptr<string> data;
+    vector<KvSlice> recs; //point into data
+};
+
+//sort a chunk of input and write it to a run file. later records of the same key win
+static Status writeRun(vector<KvSlice>& recs, const string& name) {
+    stable_sort(recs.begin(), recs.end(), [](const KvSlice& a, const KvSlice& b) { return a.first.compare(b.first) < 0; });
+    FILE* fp = fopen(name.c_str(), "w");
+    if (fp == NULL) {
+        return Status::ioError("fopen", name);
+    }
+    setvbuf(fp, NULL, _IOFBF, 1024*1024);
+    for (size_t i = 0; i < recs.size(); i ++) {
+        if (i + 1 < recs.size() && recs[i].first == recs[i+1].first) {
+            continue;
+        }
+        writeBin(fp, recs[i].first, recs[i].second);
+    }
+    bool ok = !ferror(fp);
+    ok = fclose(fp) == 0 && ok;
+    return ok ? Status() : Status::ioError("write", name);
+}
+
+//phase 1: cut inputs into chunks of memory/threads bytes, sort them in parallel into run files
+static Status sortRuns(LoadOptions& opt, const string& tmpdir, vector<string>* runs) {
+    int64_t chunkSize = opt.memory / opt.threads;
+    ThreadPool pool(opt.threads);
+    mutex mu;
+    condition_variable cv;
+    int inflight = 0;
+    Status result;
+    auto parse = opt.format == "bin" ? parseBin : parseKv;
+    shared_ptr<string> chunk(new string);
+    chunk->reserve(chunkSize);
+    //sort the complete records of chunk in background, the partial one at end is kept for next chunk
+    auto flush = [&](bool last) {
+        shared_ptr<SortRun> run(new SortRun);
+        vector<KvSlice>* recs = &run->recs;
+        const char* p = chunk->data();
+        const char* pe = p + chunk->size();
+        Slice k, v;
+        int64_t r = 0;
+        for (; p < pe && (r = parse(p, pe, &k, &v)) > 0; p += r) {
+            if (isMetaKey(k)) {
+                warn("reserved key skipped: %.*s", (int)k.size(), k.data());
+                continue;
+            }
+            recs->push_back(KvSlice(k, v));
+        }
+        if (r < 0 || (p < pe && (last || p == chunk->data()))) {
+            return Status::fromFormat(EINVAL, "bad record, incomplete or larger than a chunk in run %ld", (long)runs->size());
+        }
+        shared_ptr<string> next(new string(p, pe));
+        next->reserve(chunkSize);
+        run->data = chunk;
+        chunk = next;
+        if (recs->empty()) {
+            return Status();
+        }
+        string name = tmpdir + util::format("run-%05ld", (long)runs->size());
+        runs->push_back(name);
+        {
+            unique_lock<mutex> lk(mu);
+            cv.wait(lk, [&]{ return inflight < opt.threads; });
+            inflight ++;
+        }
+        info("sorting run %s %ld records", name.c_str(), (long)recs->size());
+        pool.addTask([=, &mu, &cv, &inflight, &result] {
+            Status s = writeRun(run->recs, name);
+            lock_guard<mutex> lk(mu);
+            if (!s.ok()) {
+                result = s;
+            }
+            inflight --;
+            cv.notify_all();
+        });
+        return Status();
+    };
+    Status st;
+    for (size_t f = 0; st.ok() && f < opt.inputs.size(); f ++) {
+        int fd = open(opt.inputs[f].c_str(), O_RDONLY);
+        if (fd < 0) {
+            st = Status::ioError("open", opt.inputs[f]);
+            break;
+        }
+        while (st.ok()) {
+            size_t old = chunk->size();
+            chunk->resize(chunkSize);
+            ssize_t r = read(fd, &(*chunk)[old], chunkSize - old);
+            chunk->resize(old + max(r, (ssize_t)0));
+            if (r < 0) {
+                st = Status::ioError("read", opt.inputs[f]);
+            } else if (r == 0) {
+                break;
+            } else if ((int64_t)chunk->size() == chunkSize) {
+                st = flush(false);
+            }
+        }
+        close(fd);
+    }
+    if (st.ok()) {
+        st = flush(true);
+    }
+    pool.exit().join();
+    return st.ok() ? result : st;
+}
+
+//a run file being merged
+struct RunReader {
+    FILE* fp;
+    size_t idx;
+    string key, value;
+    RunReader(): fp(NULL), idx(0) {}
+    ~RunReader() { if (fp) { fclose(fp); } }
+    bool next() {
+        int32_t head[2];
+        if (fread(head, sizeof head, 1, fp) != 1) {
+            return false;
+        }
+        key.resize(head[0]);
+        value.resize(head[1]);
+        return fread(&key[0], head[0], 1, fp) == 1 && (head[1] == 0 || fread(&value[0], head[1], 1, fp) == 1);
+    }
+};
+
+//phase 2: merge runs into leveldb in key order. for the same key, the latest run wins
+static Status mergeRuns(LoadOptions& opt, vector<string>& runs, int64_t* count) {
+    leveldb::Options options;
+    options.create_if_missing = true;
+    options.error_if_exists = true;
+    options.write_buffer_size = 256*1024*1024;
+    leveldb::DB* db = NULL;
+    Status st = (ConvertStatus)leveldb::DB::Open(options, opt.dbdir+"ldb", &db);
+    if (!st.ok()) {
+        return st;
+    }
+    unique_ptr<leveldb::DB> rel1(db);
+    vector<unique_ptr<RunReader>> readers;
+    auto later = [&readers](size_t a, size_t b) {
+        int c = Slice(readers[a]->key).compare(readers[b]->key);
+        return c > 0 || (c == 0 && a < b);
+    };
+    priority_queue<size_t, vector<size_t>, decltype(later)> heap(later);
+    for (size_t i = 0; i < runs.size(); i ++) {
+        readers.push_back(unique_ptr<RunReader>(new RunReader));
+        RunReader* r = readers.back().get();
+        r->idx = i;
+        r->fp = fopen(runs[i].c_str(), "r");
+        if (r->fp == NULL) {
+            return Status::ioError("fopen", runs[i]);
+        }
+        setvbuf(r->fp, NULL, _IOFBF, 1024*1024);
+        if (r->next()) {
+            heap.push(i);
+        }
+    }
+    leveldb::WriteBatch batch;
+    string lastKey, scratch;
+    size_t batchBytes = 0;
+    *count = 0;
+    while (heap.size()) {
+        size_t i = heap.top();
+        heap.pop();
+        RunReader* r = readers[i].get();
+        if (*count == 0 || r->key != lastKey) {
+            batch.Put(r->key, convSlice(ValueMeta().encode(r->value, &scratch)));
+            batchBytes += r->key.size() + r->value.size();
+            lastKey = r->key;
+            if (++*count % 1000000 == 0) {
+                info("%ld keys loaded", (long)*count);
+            }
+        }
+        if (r->next()) {
+            heap.push(i);
+        }
+        if (batchBytes >= 4*1024*1024 || heap.empty()) {
+            st = (ConvertStatus)db->Write(leveldb::WriteOptions(), &batch);
+            if (!st.ok()) {
+                return st;
+            }
+            batch.Clear();
+            batchBytes = 0;
+        }
+    }
+    return st;
+}
+
+static Status writeSlaveStatus(const string& dbdir, const string& slave) {
+    vector<Slice> ss = Slice(slave).split(':');
+    if (ss.size() != 4) {
+        return Status::fromFormat(EINVAL, "bad slave %s, should be host:port:fileno:offset", slave.c_str());
+    }
+    SyncPos pos;
+    pos.fileno = util::atoi(ss[2].data(), ss[2].end());
+    pos.offset = util::atoi(ss[3].data(), ss[3].end());
+    string cont = util::format("%.*s #host\n%d #port\n%s", (int)ss[0].size(), ss[0].data(),
+        (int)util::atoi(ss[1].data(), ss[1].end()), pos.toLines().c_str());
+    return file::writeContent(dbdir + FileName::slaveFile(), cont);
+}
+
+int main(int argc, const char* argv[]) {
+    LoadOptions opt;
+    char* const* gv = (char* const*)argv;
+    for (int ch=0; (ch=getopt(argc, gv, "d:t:m:j:s:h"))!= -1;) {
+        switch(ch) {
+        case 'd': opt.dbdir = optarg; break;
+        case 't': opt.format = optarg; break;
+        case 'm': opt.memory = util::atoi(optarg) * 1024 * 1024; break;
+        case 'j': opt.threads = max(1L, util::atoi(optarg)); break;
+        case 's': opt.slave = optarg; break;
+        default:
+            printf(usage, argv[0]);
+            return 1;
+        }
+    }
+    for (int i = optind; i < argc; i ++) {
+        opt.inputs.push_back(argv[i]);
+    }
+    if (opt.inputs.empty() || (opt.format != "kv" && opt.format != "bin") || opt.memory <= 0) {
+        printf(usage, argv[0]);
+        return 1;
+    }
+    opt.dbdir = addSlash(opt.dbdir);
+    string tmpdir = opt.dbdir + "load-tmp/";
+    file::createDir(opt.dbdir);
+    Status st = file::createDir(tmpdir);
+    exitif(!st.ok(), "create dir %s failed %s", tmpdir.c_str(), st.toString().c_str());
+
+    int64_t start = util::timeMilli();
+    vector<string> runs;
+    st = sortRuns(opt, tmpdir, &runs);
+    exitif(!st.ok(), "sort input failed %s", st.toString().c_str());
+    info("%ld runs sorted in %ld ms", (long)runs.size(), (long)(util::timeMilli() - start));
+
+    int64_t count = 0;
+    st = mergeRuns(opt, runs, &count);
+    exitif(!st.ok(), "load into %sldb failed %s", opt.dbdir.c_str(), st.toString().c_str());
+    for (auto& r: runs) {
+        file::deleteFile(r);
+    }
+    file::deleteDir(tmpdir);
+
+    //an empty binlog and a clean close mark, leveldbd starts writing binlog from the first file
+    file::createDir(opt.dbdir + "binlog/");
+    st = file::writeContent(opt.dbdir + FileName::closedFile(), "1");
+    if (st.ok() && opt.slave.size()) {
+        st = writeSlaveStatus(opt.dbdir, opt.slave);
+    }
+    exitif(!st.ok(), "write db files failed %s", st.toString().c_str());
+    info("%ld keys loaded into %s in %ld ms", (long)count, opt.dbdir.c_str(), (long)(util::timeMilli() - start));
+    return 0;
+}
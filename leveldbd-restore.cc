@@ -0,0 +1,138 @@
+#include <handy/status.h>
+#include <handy/file.h>
+#include <handy/logging.h>
+#include <time.h>
+#include "globals.h"
+#include "logdb.h"
+
+//point in time restore. a copy of the db directory is opened as base, binlog of the source db
+//is replayed on it from the end of the copy's binlog up to the last record not later than the given time
+
+const char* usage = "usage: %s -f config_of_base_copy -l source_binlog_dir -t time [-p fileno:offset]\n"
+    "  -t time as 'YYYY-mm-dd HH:MM:SS' in local time or unix seconds\n"
+    "  -p binlog position to replay from, default is the end of binlog in the base copy\n";
+
+static int64_t parseTime(const string& s) {
+    struct tm t;
+    memset(&t, 0, sizeof t);
+    const char* p = strptime(s.c_str(), "%Y-%m-%d %H:%M:%S", &t);
+    if (p && *p == 0) {
+        t.tm_isdst = -1;
+        return mktime(&t);
+    }
+    return util::atoi(s.c_str());
+}
+
+//replay records of dir from (fileno, offset) to (endno, endoff) in batches of g_batch_count
+static Status replay(LogDb* db, const string& dir, int64_t fileno, int64_t offset, int64_t endno, int64_t endoff, int64_t* count) {
+    Status st;
+    vector<string> datas;
+    vector<LogRecord> recs;
+    string scratch;
+    Slice rec;
+    auto apply = [&] {
+        recs.resize(datas.size());
+        for (size_t i = 0; st.ok() && i < datas.size(); i ++) {
+            st = LogRecord::decodeRecord(datas[i], &recs[i]);
+        }
+        if (st.ok() && recs.size()) {
+            st = db->applyLogs(recs, false);
+        }
+        *count += recs.size();
+        datas.clear();
+        recs.clear();
+    };
+    for (; st.ok() && fileno <= endno; fileno ++, offset = 0) {
+        LogFile lf;
+        st = lf.open(dir+FileName::binlogFile(fileno));
+        while (st.ok() && (fileno < endno || offset < endoff)) {
+            st = lf.getRecord(&offset, &rec, &scratch);
+            if (!st.ok() || rec.empty()) {
+                break;
+            }
+            datas.push_back(rec);
+            if ((int)datas.size() >= g_batch_count) {
+                apply();
+            }
+        }
+        info("binlog %ld replayed to %ld, %ld records applied", (long)fileno, (long)offset, (long)*count);
+    }
+    if (st.ok()) {
+        apply();
+    }
+    return st;
+}
+
+//end of the last non-empty binlog file in dir, fileno 0 if there is none
+static Status binlogEnd(const string& dir, int64_t* fileno, int64_t* offset) {
+    vector<string> files;
+    *fileno = *offset = 0;
+    Status st = file::getChildren(dir, &files);
+    if (st.code() == ENOENT) {
+        return Status();
+    }
+    for (auto& f: files) {
+        int64_t n = FileName::binlogNum(f);
+        size_t sz = 0;
+        if (n > *fileno && file::getFileSize(dir+f, &sz).ok() && sz > 0) {
+            *fileno = n;
+            *offset = sz;
+        }
+    }
+    return st;
+}
+
+int main(int argc, const char* argv[]) {
+    string config, srcdir, tm, pos;
+    char* const* gv = (char* const*)argv;
+    for (int ch=0; (ch=getopt(argc, gv, "f:l:t:p:h"))!= -1;) {
+        switch(ch) {
+        case 'f': config = optarg; break;
+        case 'l': srcdir = optarg; break;
+        case 't': tm = optarg; break;
+        case 'p': pos = optarg; break;
+        default:
+            printf(usage, argv[0]);
+            return 1;
+        }
+    }
+    int64_t target = parseTime(tm);
+    if (config.empty() || srcdir.empty() || target <= 0) {
+        printf(usage, argv[0]);
+        return 1;
+    }
+    int r = g_conf.parse(config.c_str());
+    exitif(r, "config %s parse error at line %d", config.c_str(), r);
+    setGlobalConfig(g_conf);
+    //the copy has the same binlog files as the source up to the moment it was taken.
+    //the end is taken before init, which opens a new empty binlog file
+    int64_t fileno = 0, offset = 0;
+    Status st = binlogEnd(addSlash(g_conf.get("", "dbdir", "ldbd")) + "binlog/", &fileno, &offset);
+    exitif(!st.ok(), "read binlog of base copy failed %s", st.toString().c_str());
+    LogDb db;
+    st = db.init(g_conf);
+    exitif(!st.ok(), "open base copy failed %s", st.toString().c_str());
+
+    if (pos.size()) {
+        vector<Slice> ps = Slice(pos).split(':');
+        exitif(ps.size() != 2, "bad position %s, should be fileno:offset", pos.c_str());
+        fileno = util::atoi(ps[0].data(), ps[0].end());
+        offset = util::atoi(ps[1].data(), ps[1].end());
+    } else if (fileno == 0) {
+        warn("no binlog in base copy, replay from the first binlog of %s", srcdir.c_str());
+        fileno = 1;
+    }
+    srcdir = addSlash(srcdir);
+    int64_t endno = 0, endoff = 0;
+    st = LogDb::findBinlogPos(srcdir, target, &endno, &endoff);
+    exitif(!st.ok(), "find binlog position of %ld failed %s", (long)target, st.toString().c_str());
+    exitif(endno < fileno || (endno == fileno && endoff < offset),
+        "base copy at %ld %ld is later than %s at %ld %ld", (long)fileno, (long)offset, tm.c_str(), (long)endno, (long)endoff);
+
+    int64_t start = util::timeMilli(), count = 0;
+    info("replaying %s from %ld %ld to %ld %ld", srcdir.c_str(), (long)fileno, (long)offset, (long)endno, (long)endoff);
+    st = replay(&db, srcdir, fileno, offset, endno, endoff, &count);
+    exitif(!st.ok(), "replay failed after %ld records %s", (long)count, st.toString().c_str());
+    info("restored to %s, %ld records replayed in %ld ms", tm.c_str(), (long)count, (long)(util::timeMilli() - start));
+    return 0;
+}
@@ -6,11 +6,17 @@
 #include <handy/file.h>
 #include "globals.h"
 #include "binlog-msg.h"
+#include "resp-server.h"
+#include "compactor.h"
+#include "async-log.h"
+#include "anti-entropy.h"
+#include "alloc-stats.h"
+#include "ingest.h"
 
-void setupStatServer(StatServer& svr, EventBase& base, LogDb* db, const char* argv[]);
+void setupStatServer(StatServer& svr, EventBase& base, LogDb* db, ThreadPool* wpool, Compactor* compactor, AntiEntropy* ae, const char* argv[]);
 void handleHttpReq(EventBase& base, LogDb* db, const HttpConnPtr& con, ThreadPool& rpool, ThreadPool& wpool);
 void processArgs(int argc, const char* argv[], Conf& conf);
-void httpConnectTo(ThreadPool* wpool, LogDb* db, EventBase* base, const string& ip, int port);
+void httpConnectTo(ThreadPool* wpool, LogDb* db, EventBase* base, size_t idx);
 
 int main(int argc, const char* argv[]) {
     string program = argv[0];
@@ -25,15 +31,20 @@ int main(int argc, const char* argv[]) {
     Logger::getLogger().setLogLevel(loglevel);
 
     info("program begin. loglevel %s", loglevel.c_str());
+    AsyncLog::instance().start(g_conf.getInteger("", "log_buffer", 1024)*1024, g_conf.getInteger("", "access_log_sample", 1));
     //setup thread pool
     ThreadPool readPool(g_conf.getInteger("", "read_threads", 8));
     ThreadPool writePool(1);
 
     //setup db
     setGlobalConfig(g_conf);
+    KeyFilter filter;
+    exitif(!filter.parse(g_sync_filter), "bad sync_filter '%s'", g_sync_filter.c_str());
     LogDb db;
     Status st = db.init(g_conf);
     fatalif(!st.ok(), "LogDb init failed. %s", st.msg());
+    Compactor compactor(db.getdb());
+    compactor.init(g_conf);
 
     //setup network
     string ip = g_conf.get("", "bind", "");
@@ -46,44 +57,103 @@ int main(int argc, const char* argv[]) {
     StatServer statsvr(&base);
     r = statsvr.bind(ip, stat_port);
     exitif(r, "bind failed %d %s", errno, strerror(errno));
-    leveldbd.onDefault([&](const HttpConnPtr& con) {
-        handleHttpReq(base, &db, con, readPool, writePool);
+    //requests are read by onHttpRead instead of HttpServer, so large batch bodies are applied while arriving
+    leveldbd.onConnCreate([&] {
+        TcpConnPtr con(new TcpConn);
+        auto read = [&](const TcpConnPtr& con) {
+            onHttpRead(con, &db, &writePool, [&](const HttpConnPtr& hcon) { handleHttpReq(base, &db, hcon, readPool, writePool); });
+        };
+        con->onRead(read);
+        con->onWritable([read](const TcpConnPtr& con) {
+            if (sendPendingValue(con)) {
+                read(con);
+            }
+        });
+        return con;
     });
+    unique_ptr<TcpServer> respsvr;
+    int resp_port = g_conf.getInteger("", "resp_port", 0);
+    if (resp_port) {
+        respsvr.reset(new TcpServer(&base));
+        r = respsvr->bind(ip, resp_port);
+        exitif(r, "bind failed %d %s", errno, strerror(errno));
+        setupRespServer(*respsvr, base, &db, readPool, writePool);
+    }
     base.runAfter(3000, [&]{ sendEmptyBinlog(&base, &db); }, 5000);
-    setupStatServer(statsvr, base, &db, argv);
+    base.runAfter(1000, [&]{ db.scans_.expire(); }, 1000);
+    base.runAfter(100, [&]{ db.refreshLevel0(); }, 100);
+    base.runAfter(60*1000, [&]{ compactor.checkWindow(); }, 60*1000);
+    if (db.blobs_.enabled() && g_blob_gc_rate > 0) {
+        base.runAfter(1000, [&]{ writePool.addTask([&]{ db.gcBlobs(g_blob_gc_rate); }); }, 1000);
+    }
+    if (db.hotKeys_.enabled()) {
+        base.runAfter(db.hotKeys_.decayInterval_*1000, [&]{ db.hotKeys_.decay(); }, db.hotKeys_.decayInterval_*1000);
+    }
+    if (db.hotKeys_.warm_) {
+        int interval = max(1L, g_conf.getInteger("", "warm_save_interval", 300)) * 1000;
+        base.runAfter(interval, [&]{ writePool.addTask([&]{ db.warmup_.save(); }); }, interval);
+        db.warmup_.start(db.getdb());
+    }
+    if (g_expire_rate > 0) {
+        base.runAfter(1000, [&]{ writePool.addTask([&]{ db.removeExpired(g_expire_rate); db.purgeDeleted(g_expire_rate); }); }, 1000);
+    }
+    AntiEntropy antiEntropy(&db, &base, &writePool);
+    setupStatServer(statsvr, base, &db, &writePool, &compactor, &antiEntropy, argv);
 
-    if (db.slaveStatus_.isValid()) {
-        httpConnectTo(&writePool, &db, &base, db.slaveStatus_.host, db.slaveStatus_.port);
+    for (size_t i = 0; i < db.slaves_.size(); i ++) {
+        if (db.slaves_[i].isValid()) {
+            httpConnectTo(&writePool, &db, &base, i);
+        }
     }
     Signal::signal(SIGINT, [&]{base.exit(); });
     base.loop();
+    antiEntropy.exit();
+    db.warmup_.exit();
     readPool.exit().join();
     writePool.exit().join();
+    compactor.exit();
+    AsyncLog::instance().stop();
     return 0;
 }
 
 void handleHttpReq(EventBase& base, LogDb* db, const HttpConnPtr& con, ThreadPool& rpool, ThreadPool& wpool){
     HttpRequest& req = con.getRequest();
-    ThreadPool* pool = req.method == "GET" && !Slice(req.uri).starts_with("/nav-")? &rpool: &wpool;
-    pool->addTask([=, &base] { handleReq(base, db, con); });
+    Slice uri = req.uri;
+    if (uri.starts_with("/binlog/") || uri.starts_with("/cdc/")) { //long polls of slaves and cdc readers, not shed by load
+        rpool.addTask([=, &base] { handleReq(base, db, con); });
+        return;
+    }
+    //nav pages are writes only when they delete a key
+    bool write = req.method != "GET" || (uri.starts_with("/nav-") && req.getArg("d").size());
+    addReqTask(&base, write ? wpool : rpool, db, write, [=, &base] { handleReq(base, db, con); },
+        [=, &base](const char* reason) {
+            base.safeCall([con, reason] {
+                warn("req %s rejected: %s", con.getRequest().query_uri.c_str(), reason);
+                HttpResponse& resp = con.getResponse();
+                resp.setStatus(503, "Service Unavailable");
+                resp.headers["Retry-After"] = "1";
+                con.sendResponse();
+            });
+        });
 }
 
-void httpConnectTo(ThreadPool* wpool, LogDb* db, EventBase* base, const string& ip, int port) {
-    HttpConnPtr con = TcpConn::createConnection(base, ip, port, 200);
+void httpConnectTo(ThreadPool* wpool, LogDb* db, EventBase* base, size_t idx) {
+    SlaveStatus ss = db->getSlaveStatusLock(idx);
+    HttpConnPtr con = TcpConn::createConnection(base, ss.host, ss.port, 200);
+    SyncChannelPtr ch(new SyncChannel(db, base, wpool, idx));
     con->onState([=](const TcpConnPtr& con) {
         TcpConn::State st = con->getState();
         HttpConnPtr hcon = con;
         if (st == TcpConn::Connected) {
-            wpool->addTask([=]{sendSyncReq(db, base, con); });
+            startSync(ch, hcon);
         } else if (st == TcpConn::Failed || st == TcpConn::Closed) {
-            base->runAfter(3000, [=]{ httpConnectTo(wpool, db, base, ip, port); });
+            ch->closed = true;
+            base->runAfter(3000, [=]{ httpConnectTo(wpool, db, base, idx); });
         }
     });
 
     con.onHttpMsg([=](const HttpConnPtr& hcon) {
-        wpool->addTask([=]{
-            processSyncResp(db, hcon, base);
-        });
+        processSyncResp(ch, hcon);
     });
 }
 
@@ -125,27 +195,144 @@ void processArgs(int argc, const char* argv[], Conf& g_conf){
     }
 }
 
-void setupStatServer(StatServer& svr, EventBase& base, LogDb* db, const char* argv[]) {
+void setupStatServer(StatServer& svr, EventBase& base, LogDb* db, ThreadPool* wpool, Compactor* compactor, AntiEntropy* ae, const char* argv[]) {
     svr.onState("loglevel", "log level for server", []{return Logger::getLogger().getLogLevelStr(); });
     svr.onState("pid", "process id of server", [] { return getpid(); });
+    svr.onState("log-bytes", "bytes written by async log", [] { return AsyncLog::instance().bytes_.load(); });
+    svr.onState("log-drops", "async log lines dropped for full ring", [] { return AsyncLog::instance().drops_.load(); });
+    svr.onState("allocs", "heap allocations of the process", [] { return AllocStats::instance().allocs(); });
+    svr.onState("alloc-bytes", "bytes allocated from heap, not counting frees", [] { return AllocStats::instance().bytes(); });
+    svr.onState("allocs-per-request", "heap allocations of the process per http request served", [] {
+        int64_t n = AllocStats::instance().requests();
+        return n ? AllocStats::instance().allocs() / n : 0;
+    });
     svr.onState("space", "total space of db kB", [db] { return getSize("/", "=", db->getdb())/1024; });
     svr.onState("dbid", "dbid of this db", [db] { return db->dbid_; });
+    svr.onState("cas-ok", "cas requests succeeded", [db] { return db->casOk_.load(); });
+    svr.onState("cas-fail", "cas requests failed for value mismatch", [db] { return db->casFail_.load(); });
+    svr.onState("read-queue", "read requests waiting in queue", [] { return g_admission.readQueued.load(); });
+    svr.onState("write-queue", "write requests waiting in queue", [] { return g_admission.writeQueued.load(); });
+    svr.onState("level0-files", "leveldb files at level0", [db] { return db->level0_.load(); });
+    svr.onState("reject-queue", "requests rejected for full queue", [] { return g_admission.queueRejects.load(); });
+    svr.onState("reject-wait", "requests rejected for waiting too long", [] { return g_admission.waitRejects.load(); });
+    svr.onState("reject-level0", "writes rejected for too many level0 files", [] { return g_admission.level0Rejects.load(); });
+    //leveldb.sstables is parsed once for the level states of a stat request, they are read one after another
+    struct LevelBytes { int64_t at; int64_t bytes[LEVELDB_LEVELS]; };
+    shared_ptr<LevelBytes> lb(new LevelBytes);
+    lb->at = 0;
+    for (int i = 0; i < LEVELDB_LEVELS; i ++) {
+        string pre = util::format("level%d-", i);
+        svr.onState(pre+"files", "leveldb files at the level", [db, i] {
+            string v;
+            db->getdb()->GetProperty(util::format("leveldb.num-files-at-level%d", i), &v);
+            return v;
+        });
+        svr.onState(pre+"bytes", "leveldb bytes at the level", [db, i, lb] {
+            int64_t now = util::timeMilli();
+            if (now - lb->at > 100) {
+                getLevelBytes(db->getdb(), lb->bytes);
+                lb->at = now;
+            }
+            return lb->bytes[i];
+        });
+    }
+    for (Keyspace* ks: db->keyspaces_.all()) {
+        string pre = "ks-" + ks->name + "-";
+        leveldb::DB* kdb = ks->db;
+        svr.onState(pre+"space", "space of keyspace kB", [kdb] { return getSize("", "\xff", kdb)/1024; });
+        svr.onState(pre+"cache", "block cache of keyspace in use kB", [ks] { return (int64_t)ks->cache->TotalCharge()/1024; });
+        svr.onState(pre+"level0-files", "leveldb files at level0 of keyspace", [kdb] {
+            string v;
+            kdb->GetProperty("leveldb.num-files-at-level0", &v);
+            return v;
+        });
+    }
+    svr.onState("compacting", "manual compaction running", [compactor] { return compactor->running_.load(); });
+    svr.onState("compact-bytes", "bytes compacted by the manual compaction", [compactor] { return compactor->doneBytes_.load(); });
+    svr.onState("blob-files", "blob files of large values", [db] { return db->blobs_.fileCount(); });
+    HotKeys* hot = &db->hotKeys_;
+    svr.onState("hot-read-keys", "sampled top read keys as 'key count bytes'", [hot] { return hot->reads_.report(hot->sample_); });
+    svr.onState("hot-write-keys", "sampled top written keys as 'key count bytes'", [hot] { return hot->writes_.report(hot->sample_); });
+    svr.onState("hot-prefixes", "sampled top key prefixes of reads and writes as 'prefix count bytes'", [hot] {
+        return hot->prefixes_.report(hot->sample_);
+    });
+    svr.onState("warm-keys", "read keys sampled for warm up of the next start", [db] { return db->warmup_.size(); });
+    svr.onState("warmup-running", "warm up of block cache running", [db] { return db->warmup_.running_.load(); });
+    svr.onState("warmup-total", "keys to read in warm up", [db] { return db->warmup_.total_.load(); });
+    svr.onState("warmup-done", "keys read in warm up", [db] { return db->warmup_.done_.load(); });
+    svr.onState("scan-sessions", "open range scan sessions", [db] { return db->scans_.size(); });
+    svr.onState("binlog-tail-hits", "binlog reads served from the in-memory tail", [db] { return db->tail_.hits_.load(); });
+    svr.onState("binlog-tail-misses", "binlog reads falling back to files", [db] { return db->tail_.misses_.load(); });
+    svr.onState("binlog-shared-fetches", "binlog batches reused by readers woken by the same write", [db] { return db->sharedFetches_.load(); });
+    svr.onState("cdc-events", "change events sent to cdc subscribers", [db] { return db->cdcEvents_.load(); });
     svr.onState("binlog-file", "current binlog file no of this db", [db] { return db->lastFile_; });
     svr.onState("binlog-offset", "current binlog file offset", [db] { 
         size_t sz = 0;
         Status st = file::getFileSize(db->binlogDir_+FileName::binlogFile(db->lastFile_), &sz);
         return sz;
     });
-    svr.onState("slave-current-key", "slave key of this db", [db] { return db->getSlaveStatusLock().pos.key; });
-    svr.onState("slave-file", "slave file of this db", [db] { return db->getSlaveStatusLock().pos.fileno; });
-    svr.onState("slave-offset", "slave offset of this db", [db] { return db->getSlaveStatusLock().pos.offset; });
+    svr.onState("slave-current-key", "slave key of this db", [db] { return db->getSlaveStatusLock(0).pos.key; });
+    svr.onState("slave-file", "slave file of this db", [db] { return db->getSlaveStatusLock(0).pos.fileno; });
+    svr.onState("slave-offset", "slave offset of this db", [db] { return db->getSlaveStatusLock(0).pos.offset; });
+    for (size_t i = 0; i < db->slaves_.size(); i ++) {
+        string pre = util::format("slave%ld-", (long)i);
+        string master = db->slaves_[i].host + util::format(":%d", db->slaves_[i].port);
+        svr.onState(pre+"master", "master followed by channel", [master] { return master; });
+        svr.onState(pre+"file", "slave file of channel", [db, i] { return db->getSlaveStatusLock(i).pos.fileno; });
+        svr.onState(pre+"offset", "slave offset of channel", [db, i] { return db->getSlaveStatusLock(i).pos.offset; });
+        svr.onState(pre+"lag", "seconds channel is behind master", [db, i] { return db->getSlaveStatusLock(i).lag; });
+        svr.onState(pre+"records", "records applied by channel", [db, i] { return db->getSlaveStatusLock(i).records; });
+        svr.onState(pre+"bytes", "bytes received by channel", [db, i] { return db->getSlaveStatusLock(i).bytes; });
+    }
+    svr.onRequest(StatServer::CMD, "compact", "compact leveldb in background, args begin end for a key range",
+        [compactor](const HttpRequest& req, HttpResponse& resp) {
+            HttpRequest& r = const_cast<HttpRequest&>(req);
+            resp.body = compactor->start(r.getArg("begin"), r.getArg("end")) ? "compaction started" : "compaction is running";
+        });
+    svr.onState("verify-running", "anti-entropy check running", [ae] { return ae->running_.load(); });
+    svr.onState("verify-checked", "ranges compared with master by anti-entropy", [ae] { return ae->checked_.load(); });
+    svr.onState("verify-differ", "pieces differing from master", [ae] { return ae->differ_.load(); });
+    svr.onState("verify-repaired", "keys rewritten or deleted by anti-entropy", [ae] { return ae->repaired_.load(); });
+    svr.onState("range-hash-pieces", "cached hashes of key ranges", [db] { return db->rangeHashes_.size(); });
+    svr.onRequest(StatServer::CMD, "verify", "compare data with master and repair differences, args ch for channel, repair=0 only counts",
+        [ae](const HttpRequest& req, HttpResponse& resp) {
+            HttpRequest& r = const_cast<HttpRequest&>(req);
+            bool repair = r.getArg("repair") != "0";
+            resp.body = ae->start(util::atoi(r.getArg("ch").c_str()), repair) ? "verify started" : "verify is running or not a slave";
+        });
+    svr.onState("index-stale", "index entries skipped by index-get as their key no longer has the term", [db] {
+        return db->indexes_.stale_.load();
+    });
+    svr.onCmd("reindex", "add index entries of keys written before the indexes were configured, remove stale entries", [db, wpool] {
+        wpool->addTask([db] {
+            int64_t n = 0, removed = 0;
+            db->rebuildIndexes(&n, &removed);
+        });
+        return "reindex started";
+    });
     svr.onCmd("lesslog", "set log to less detail", []{ Logger::getLogger().adjustLogLevel(-1); return "OK"; });
     svr.onCmd("morelog", "set log to more detail", [] { Logger::getLogger().adjustLogLevel(1); return "OK"; });
-    svr.onCmd("restart", "restart program", [&] { 
-        base.safeCall([&]{ base.exit(); Daemon::changeTo(argv);}); 
+    svr.onCmd("restart", "restart program", [&base, db, wpool, argv] { 
+        //the new process warms up with the keys read until now, saved in the write thread as the timer does
+        wpool->addTask([&base, db, argv] {
+            if (db->hotKeys_.warm_) {
+                db->warmup_.save();
+            }
+            base.safeCall([&base, argv]{ base.exit(); Daemon::changeTo(argv);}); 
+        });
         return "restarting"; 
     });
     svr.onCmd("stop", "stop program", [&] { base.safeCall([&]{base.exit();}); return "stoping"; });
+    svr.onPage("leveldb-stats", "leveldb compaction stats", [db] {
+        string v;
+        db->getdb()->GetProperty("leveldb.stats", &v);
+        return v;
+    });
+    svr.onPage("leveldb-sstables", "leveldb sstables of each level", [db] {
+        string v;
+        db->getdb()->GetProperty("leveldb.sstables", &v);
+        return v;
+    });
     svr.onPageFile("config", "show config file", g_conf.filename);
     svr.onPageFile("help", "show help", g_conf.get("", "help_file", "README"));
 }
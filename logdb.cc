@@ -2,6 +2,7 @@
 #include <handy/file.h>
 #include "handler.h"
 #include "binlog-msg.h"
+#include "async-log.h"
 
 int64_t FileName::binlogNum(const string& name) {
     Slice s1(name);
@@ -37,7 +38,7 @@ Status LogRecord::encodeRecord(string* data){
     char* p = (char*)data->c_str();
     bin_writeValue(p, (int32_t)dbid);
     bin_writeValue(p, (int64_t)tm);
-    bin_writeValue(p, (int32_t)op);
+    bin_writeValue(p, (int32_t)(op | ks << 8));
     bin_writeValue(p, (int32_t)key.size());
     bin_write(p, key.data(), key.size());
     bin_writeValue(p, (int32_t)value.size());
@@ -55,7 +56,9 @@ Status LogRecord::decodeRecord(Slice data, LogRecord* rec){
     }
     rec->dbid = bin_readValue<int32_t>(p);
     rec->tm = bin_readValue<int64_t>(p);
-    rec->op = (BinlogOp)bin_readValue<int32_t>(p);
+    int32_t op = bin_readValue<int32_t>(p);
+    rec->op = (BinlogOp)(op & 0xff);
+    rec->ks = op >> 8;
     size_t len = bin_readValue<int32_t>(p);
     if (data.size() < isz+len) {
         return es;
@@ -72,6 +75,21 @@ Status LogRecord::decodeRecord(Slice data, LogRecord* rec){
 }
 
 
+ValueMeta LogRecord::decodeValue(Slice* v) const {
+    ValueMeta meta;
+    ValueMeta::decode(value, &meta, v);
+    if (!meta.hasVersion()) {
+        meta.flags |= ValueMeta::HasVersion;
+        meta.ts = ValueMeta::tsFromTime(tm);
+        meta.dbid = dbid;
+    }
+    if (op == BinlogDelete) {
+        meta.flags |= ValueMeta::Deleted;
+        *v = Slice();
+    }
+    return meta;
+}
+
 Status LogDb::dumpFile(const string& name) {
 
     LogFile lf;
@@ -91,11 +109,13 @@ Status LogDb::dumpFile(const string& name) {
             if (!st.ok()) {
                 break;
             }
-            printf("record %d: op %s time %ld %s key %.*s value %.*s\n", ++i,
+            Slice v;
+            ValueMeta meta = lr.decodeValue(&v);
+            printf("record %d: op %s time %ld %s version %ld/%d keyspace %d key %.*s value %.*s\n", ++i,
                 lr.op==BinlogWrite?"WRITE":"DELETE", (long)lr.tm,
-                util::readableTime(lr.tm).c_str(),
+                util::readableTime(lr.tm).c_str(), (long)meta.ts, meta.dbid, lr.ks,
                 (int)lr.key.size(), lr.key.data(),
-                (int)lr.value.size(), lr.value.data());
+                (int)v.size(), v.data());
         }
     }
     return st;
@@ -114,16 +134,49 @@ Status LogDb::init(Conf& conf) {
     options.create_if_missing = true;
     s = (ConvertStatus)leveldb::DB::Open(options, dbdir_+"ldb", &db_);
     fatalif(!s.ok(), "leveldb open failed %s", s.msg());
+    //each session may pin a memtable after it is flushed
+    int64_t scanMemory = conf.getInteger("", "scan_memory", 256) * 1024 * 1024;
+    int maxScans = min(conf.getInteger("", "scan_sessions", 64), (long)(scanMemory / options.write_buffer_size));
+    scans_.init(maxScans, conf.getInteger("", "scan_ttl", 60));
+    if (s.ok()) {
+        s = keyspaces_.open(conf, dbdir_);
+    }
+    if (s.ok()) {
+        s = indexes_.init(conf);
+    }
+    hotKeys_.init(conf);
+    warmup_.init(conf, dbdir_);
+    if (hotKeys_.enabled() && warmup_.enabled()) {
+        hotKeys_.warm_ = &warmup_;
+    }
+    rangeHashes_.init(conf.getInteger("", "merkle_piece_size", 4) * 1024 * 1024);
+    tail_.init(conf.getInteger("", "binlog_tail_size", 64) * 1024 * 1024);
+    blobThreshold_ = conf.getInteger("", "blob_threshold", 0);
+    if (s.ok() && blobThreshold_ > 0) {
+        blobGcPercent_ = conf.getInteger("", "blob_gc_percent", 50);
+        blobGcInterval_ = conf.getInteger("", "blob_gc_interval", 3600);
+        s = blobs_.init(dbdir_+"blob/", conf.getInteger("", "blob_file_size", 256)*1024*1024);
+    }
 
     if (s.ok()) {
-        s = loadSlave_();
+        s = loadSlaves_();
     }
+    for (auto& ss: slaves_) { //range-get of master reads only the default keyspace
+        if (s.ok() && !ss.pos.dataFinished && !keyspaces_.empty()) {
+            s = Status::fromFormat(EINVAL, "full sync from %s:%d copies only the default keyspace, "
+                "start a slave with keyspaces from a binlog position or time", ss.host.c_str(), ss.port);
+            error("%s", s.toString().c_str());
+        }
+    }
+    versioned_ = conf.getBoolean("", "lww", false) || slaves_.size() > 1;
+    tombstoneTtl_ = conf.getInteger("", "tombstone_ttl", 86400);
     binlogSize_ = conf.getInteger("", "binlog_size", 0);
     binlogSize_ *= 1024*1024;
     if (binlogSize_ == 0) {
         return s;
     }
     binlogDir_ = dbdir_ + "binlog/";
+    indexInterval_ = conf.getInteger("", "binlog_index_interval", 1);
     dbid_ = conf.getInteger("", "dbid", 0);
     if (dbid_ <= 0) {
         s = Status::fromFormat(EINVAL, "dbid should be set a positive interger when binlog enabled");
@@ -135,30 +188,54 @@ Status LogDb::init(Conf& conf) {
     return s;
 }
 
-Status LogDb::loadSlave_() {
-    string filename = dbdir_ + FileName::slaveFile();
+Status LogDb::loadSlaves_() {
+    vector<string> files;
+    Status st = file::getChildren(dbdir_, &files);
+    if (!st.ok()) {
+        return st;
+    }
+    sort(files.begin(), files.end());
+    for (auto& f: files) {
+        if (FileName::isSlaveFile(f)) {
+            st = loadSlave_(f);
+            if (!st.ok()) {
+                return st;
+            }
+        }
+    }
+    return st;
+}
+
+Status LogDb::loadSlave_(const string& name) {
+    string filename = dbdir_ + name;
     string cont;
     Status st = file::getContent(filename, cont);
     info("load file %s result %d", filename.c_str(), st.code());
-    if (st.code() == ENOENT) {
-        return Status();
+    if (!st.ok()) {
+        return st;
     }
+    SlaveStatus ss;
+    ss.file = name;
     Slice data = cont;
     vector<Slice> lns = data.split('\n');
     size_t c = 0;
     if (lns.size() > c) {
-        slaveStatus_.host = lns[c].eatWord();
+        ss.host = lns[c].eatWord();
     }
     if (lns.size() > ++c) {
-        slaveStatus_.port = atoi(lns[c].data());
+        ss.port = atoi(lns[c].data());
         vector<Slice> lns2;
         copy(lns.begin()+2, lns.end(), back_inserter(lns2));
-        bool r = slaveStatus_.pos.fromSlices(lns2);
+        bool r = ss.pos.fromSlices(lns2);
+        if (lns.size() > 6 && ss.pos.fileno < 0) {
+            ss.startTime = atol(lns[6].data());
+        }
         if (r) {
+            slaves_.push_back(ss);
             return Status();
         }
     }
-    st = Status::fromFormat(EINVAL, "bad format for slave status");
+    st = Status::fromFormat(EINVAL, "bad format for slave status %s", name.c_str());
     error("%s", st.toString().c_str());
     return st;
 }
@@ -223,14 +300,7 @@ Status LogDb::loadLogs_() {
                 if (!s.ok()) {
                     return s;
                 }
-                if (lr.op == BinlogWrite) {
-                    s = (ConvertStatus)db_->Put(leveldb::WriteOptions(), convSlice(lr.key), convSlice(lr.value));
-                } else if (lr.op == BinlogDelete) {
-                    s = (ConvertStatus)db_->Delete(leveldb::WriteOptions(), convSlice(lr.key));
-                } else {
-                    s = Status::fromFormat(EINVAL, "unknown binlogOp %d", lr.op);
-                    error("%s", s.toString().c_str());
-                }
+                s = operateDb_(lr);
                 break;
             }
         }
@@ -239,14 +309,18 @@ Status LogDb::loadLogs_() {
         s = file::writeContent(cfile, "0");
     }
     checkCurLog_();
+    setApplied_();
     return s;
 }
 
 LogDb::~LogDb() {
-    if (slaveStatus_.changed) {
-        saveSlave_();
+    for (auto& ss: slaves_) {
+        if (ss.changed) {
+            saveSlave_(ss);
+        }
     }
     delete curLog_;
+    scans_.clear();
     if (binlogDir_.size()) {
         file::writeContent(dbdir_ + FileName::closedFile(), "1");
     }
@@ -268,106 +342,820 @@ Status LogDb::checkCurLog_() {
         st = curLog_->open(binlogDir_+FileName::binlogFile(lastFile_+1), false);
         if (st.ok()) {
             lastFile_ ++;
+            st = tindex_.open(binlogDir_+FileName::timeIndexFile(lastFile_));
         }
     }
     return st;
 }
 
-Status LogDb::write(Slice key, Slice value) {
-    debug("write %.*s value len %ld", (int)key.size(), key.data(), value.size());
-    LogRecord rec(dbid_, time(NULL), key, value, BinlogWrite);
-    return applyRecord_(rec);
+Status LogDb::write(Slice key, Slice value, time_t expire, int ks) {
+    adebug("write %.*s value len %ld expire %ld", (int)key.size(), key.data(), value.size(), (long)expire);
+    hotKeys_.onWrite(key, key.size() + value.size());
+    LogRecord rec(dbid_, time(NULL), key, value, BinlogWrite, ks);
+    return applyRecord_(rec, expire);
 }
 
-Status LogDb::remove(Slice key) {
-    debug("remove %.*s", (int)key.size(), key.data());
-    LogRecord rec(dbid_, time(NULL), key, "", BinlogDelete);
+Status LogDb::remove(Slice key, int ks) {
+    adebug("remove %.*s", (int)key.size(), key.data());
+    hotKeys_.onWrite(key, key.size());
+    LogRecord rec(dbid_, time(NULL), key, "", BinlogDelete, ks);
     return applyRecord_(rec);
 }
 
-Status LogDb::applyLog(Slice record) {
-    LogRecord rec;
-    Status st = LogRecord::decodeRecord(record, &rec);
-    debug("applying %d %ld %s %.*s %d",
-        rec.dbid, rec.tm, strOp(rec.op), (int)rec.key.size(), rec.key.data(), (int)rec.value.size());
-    if (!st.ok() || rec.dbid == dbid_) { //ignore if dbid is self
+Status LogDb::getCurrent_(Slice key, string* value, time_t* expire) {
+    leveldb::Status s = db_->Get(leveldb::ReadOptions(), convSlice(key), value);
+    if (s.IsNotFound()) {
+        return Status(ENOENT, "not found");
+    } else if (!s.ok()) {
+        return ConvertStatus(s);
+    }
+    ValueMeta meta;
+    Slice v;
+    if (!ValueMeta::decode(*value, &meta, &v) || meta.expired(time(NULL))) {
+        value->clear();
+        return Status(ENOENT, "not found");
+    }
+    *expire = meta.hasExpire() ? meta.expire : 0;
+    if (meta.hasBlob()) {
+        return blobs_.read(meta.blobFile, meta.blobOffset, meta.blobSize, value);
+    }
+    if (v.size() != value->size()) {
+        value->erase(0, v.data() - value->data());
+    }
+    return Status();
+}
+
+Status LogDb::incr(Slice key, int64_t delta, time_t expire, int64_t* result) {
+    string cur;
+    time_t curExpire = 0;
+    Status st = getCurrent_(key, &cur, &curExpire);
+    if (!st.ok() && st.code() != ENOENT) {
+        return st;
+    }
+    int64_t n = 0;
+    if (st.ok()) {
+        char* end = NULL;
+        errno = 0;
+        n = strtoll(cur.c_str(), &end, 10);
+        if (cur.empty() || errno || *end) {
+            return Status::fromFormat(EINVAL, "value of %.*s is not an integer", (int)key.size(), key.data());
+        }
+    }
+    *result = n + delta;
+    return write(key, util::format("%ld", *result), expire < 0 ? curExpire : expire);
+}
+
+Status LogDb::cas(Slice key, const Slice* expect, Slice value, time_t expire) {
+    string cur;
+    time_t curExpire = 0;
+    Status st = getCurrent_(key, &cur, &curExpire);
+    if (!st.ok() && st.code() != ENOENT) {
         return st;
     }
+    if (st.ok() != (expect != NULL) || (expect && *expect != cur)) {
+        casFail_++;
+        return Status(ECANCELED, "cas value mismatch");
+    }
+    casOk_++;
+    return write(key, value, expire < 0 ? curExpire : expire);
+}
+
+Status LogDb::append(Slice key, Slice value, time_t expire, size_t* len) {
+    string cur;
+    time_t curExpire = 0;
+    Status st = getCurrent_(key, &cur, &curExpire);
+    if (!st.ok() && st.code() != ENOENT) {
+        return st;
+    }
+    cur.append(value.data(), value.size());
+    *len = cur.size();
+    return write(key, cur, expire < 0 ? curExpire : expire);
+}
+
+Status LogDb::applyLogs(vector<LogRecord>& recs, bool sync) {
+    Status st;
+    if (versioned_) {
+        st = resolveConflicts_(recs);
+        if (!st.ok()) {
+            return st;
+        }
+    }
     if (binlogDir_.size()) {
-        st = operateLog_(record);
+        string data;
+        for (auto& rec: recs) {
+            st = rec.encodeRecord(&data);
+            if (st.ok()) {
+                st = appendLog_(data);
+            }
+            if (!st.ok()) {
+                break;
+            }
+        }
+        if (st.ok() && sync) {
+            st = curLog_->sync();
+        }
+        notifySlaves_();
         if (!st.ok()) {
             return st;
         }
-        st = operateDb_(rec);
-    } else {
-        st = operateDb_(rec);
+    }
+    map<int, leveldb::WriteBatch> batches; //one for each keyspace, the default one is written last
+    map<string, pair<bool, string>> staged; //indexed keys staged in this batch, as resolveConflicts_ keeps versions
+    string scratch;
+    for (auto& rec: recs) {
+        adebug("applying %d %ld %s %.*s %d",
+            rec.dbid, rec.tm, strOp(rec.op), (int)rec.key.size(), rec.key.data(), (int)rec.value.size());
+        st = stageRecord_(rec, &batches[rec.ks], &scratch, &staged);
+        if (!st.ok()) {
+            return st;
+        }
+    }
+    if (sync && blobs_.enabled()) {
+        st = blobs_.sync();
+        if (!st.ok()) {
+            return st;
+        }
+    }
+    leveldb::WriteOptions wop;
+    wop.sync = sync;
+    for (auto it = batches.rbegin(); st.ok() && it != batches.rend(); ++it) {
+        st = (ConvertStatus)getdb(it->first)->Write(wop, &it->second);
+    }
+    if (st.ok()) {
+        for (auto& rec: recs) {
+            if (!rec.ks) {
+                rangeHashes_.invalidate(rec.key);
+            }
+        }
+        setApplied_();
     }
     return st;
 }
 
-Status LogDb::applyRecord_(LogRecord& rec) {
+//drop records older than the version stored, records of one batch are checked against each other too
+Status LogDb::resolveConflicts_(vector<LogRecord>& recs) {
+    map<string, ValueMeta> versions;
+    size_t n = 0;
+    string stored;
+    for (auto& rec: recs) {
+        ValueMeta cur;
+        Slice v;
+        ValueMeta meta = rec.decodeValue(&v);
+        clock_.update(meta.ts);
+        string key = rec.key;
+        key.append((const char*)&rec.ks, sizeof rec.ks);
+        auto p = versions.find(key);
+        if (p != versions.end()) {
+            cur = p->second;
+        } else if (getdb(rec.ks) == NULL) {
+            return Status::fromFormat(EINVAL, "keyspace %d not configured", rec.ks);
+        } else {
+            leveldb::Status s = getdb(rec.ks)->Get(leveldb::ReadOptions(), convSlice(rec.key), &stored);
+            if (s.ok()) {
+                Slice v;
+                ValueMeta::decode(stored, &cur, &v);
+            } else if (!s.IsNotFound()) {
+                return ConvertStatus(s);
+            }
+        }
+        if (cur.hasVersion() && meta.olderThan(cur)) {
+            adebug("conflict: %s %.*s from db %d at %ld is older than db %d, dropped",
+                strOp(rec.op), (int)rec.key.size(), rec.key.data(), rec.dbid, (long)rec.tm, cur.dbid);
+            continue;
+        }
+        versions[key] = meta;
+        recs[n++] = rec;
+    }
+    recs.resize(n);
+    return Status();
+}
+
+//version and expire travel in the binlog value, so every node stores the same ones
+Status LogDb::applyRecord_(LogRecord& rec, time_t expire) {
     Status st;
+    string scratch;
+    ValueMeta meta;
+    if (versioned_) {
+        meta = ValueMeta(clock_.now(), dbid_, rec.op == BinlogDelete);
+    }
+    if (expire) {
+        meta.setExpire(expire);
+    }
+    if (meta.flags) {
+        rec.value = meta.encode(rec.op == BinlogDelete ? Slice() : rec.value, &scratch);
+    }
     if (binlogDir_.size()) {
-        string data;
+        static thread_local string data; //reused by writes of this thread
         st = rec.encodeRecord(&data);
         if (!st.ok()) {
             return st;
         }
         st = operateLog_(data);
+        if (data.capacity() > (size_t)g_batch_size) {
+            string().swap(data);
+        }
         if (!st.ok()) {
             return st;
         }
         st = operateDb_(rec);
+        if (st.ok()) {
+            setApplied_();
+        }
     } else {
         st = operateDb_(rec);
     }
     return st;
 }
 
+Status LogDb::get(const leveldb::ReadOptions& options, Slice key, string* value, int ks) {
+    leveldb::Status s = getdb(ks)->Get(options, convSlice(key), value);
+    if (s.IsNotFound()) {
+        return Status(ENOENT, "not found");
+    } else if (!s.ok()) {
+        return ConvertStatus(s);
+    }
+    Slice v;
+    string blob;
+    Status st = resolveValue(*value, &v, &blob);
+    if (!st.ok()) {
+        return st;
+    }
+    if (v.data() == blob.data()) {
+        value->swap(blob);
+    } else if (v.size() != value->size()) {
+        value->erase(0, v.data() - value->data());
+    }
+    return Status();
+}
+
+Status LogDb::resolveValue(Slice stored, Slice* value, string* scratch) {
+    ValueMeta meta;
+    if (!ValueMeta::decode(stored, &meta, value) || meta.expired(time(NULL))) {
+        return Status(ENOENT, "not found");
+    }
+    if (meta.hasBlob()) {
+        Status st = blobs_.read(meta.blobFile, meta.blobOffset, meta.blobSize, scratch);
+        if (!st.ok()) {
+            return st;
+        }
+        *value = *scratch;
+    }
+    return Status();
+}
+
+Status LogDb::rawValue(Slice stored, Slice* raw, string* scratch) {
+    ValueMeta meta;
+    Slice v;
+    ValueMeta::decode(stored, &meta, &v);
+    *raw = stored;
+    if (!meta.hasBlob()) {
+        return Status();
+    }
+    string blob;
+    Status st = blobs_.read(meta.blobFile, meta.blobOffset, meta.blobSize, &blob);
+    if (st.ok()) {
+        meta.flags &= ~ValueMeta::HasBlob;
+        if (meta.encode(blob, scratch).data() == blob.data()) {
+            scratch->swap(blob);
+        }
+        *raw = *scratch;
+    }
+    return st;
+}
+
 Status LogDb::operateDb_(LogRecord& rec) {
-    if (rec.op == BinlogWrite) {
-        return (ConvertStatus)db_->Put(leveldb::WriteOptions(), convSlice(rec.key), convSlice(rec.value));
-    } else if (rec.op == BinlogDelete) {
-        return (ConvertStatus) db_->Delete(leveldb::WriteOptions(), convSlice(rec.key));
+    leveldb::WriteBatch batch;
+    string scratch;
+    Status st = stageRecord_(rec, &batch, &scratch);
+    if (st.ok()) {
+        st = (ConvertStatus)getdb(rec.ks)->Write(leveldb::WriteOptions(), &batch);
+    }
+    //after the write, so a range hash computed from a snapshot before it is not cached
+    if (st.ok() && !rec.ks) {
+        rangeHashes_.invalidate(rec.key);
+    }
+    return st;
+}
+
+//deletes leave a versioned mark when versioned, so an older write can not bring the key back
+Status LogDb::stageRecord_(LogRecord& rec, leveldb::WriteBatch* batch, string* scratch, map<string, pair<bool, string>>* staged) {
+    if (rec.op != BinlogWrite && rec.op != BinlogDelete) {
+        Status st = Status::fromFormat(EINVAL, "unknown op in LogRecord %d", rec.op);
+        error("%s", st.toString().c_str());
+        return st;
+    }
+    if (getdb(rec.ks) == NULL) {
+        return Status::fromFormat(EINVAL, "keyspace %d not configured", rec.ks);
+    }
+    Slice v;
+    ValueMeta meta = rec.decodeValue(&v);
+    if (!rec.ks && !indexes_.empty() && indexes_.covers(rec.key)) {
+        string stored, blob;
+        Slice ov, nv = v;
+        bool hasOld;
+        if (staged && staged->count(rec.key)) { //the old value is staged in the same batch, not in leveldb yet
+            pair<bool, string>& sv = (*staged)[rec.key];
+            hasOld = sv.first;
+            ov = sv.second;
+        } else {
+            hasOld = db_->Get(leveldb::ReadOptions(), convSlice(rec.key), &stored).ok() && resolveValue(stored, &ov, &blob).ok();
+        }
+        indexes_.stage(rec.key, hasOld ? &ov : NULL, rec.op == BinlogWrite ? &nv : NULL, batch);
+        if (staged) {
+            (*staged)[rec.key] = make_pair(rec.op == BinlogWrite, rec.op == BinlogWrite ? nv.toString() : string());
+        }
+    }
+    if (!versioned_) {
+        meta.flags &= ~(ValueMeta::HasVersion|ValueMeta::Deleted);
+    }
+    if (rec.op == BinlogDelete && !versioned_) {
+        batch->Delete(convSlice(rec.key));
+    } else if (!rec.ks && rec.op == BinlogWrite && blobs_.enabled() && (int64_t)v.size() >= blobThreshold_) { //keyspaces keep values inline
+        int64_t fileno = 0, offset = 0;
+        Status st = blobs_.append(rec.key, v, &fileno, &offset);
+        if (!st.ok()) {
+            return st;
+        }
+        meta.setBlob(fileno, offset, v.size());
+        batch->Put(convSlice(rec.key), convSlice(meta.encode("", scratch)));
+    } else {
+        batch->Put(convSlice(rec.key), convSlice(meta.encode(v, scratch)));
+    }
+    //entries are in the db of the keyspace, swept by removeExpired and purgeDeleted
+    if (rec.op == BinlogWrite && meta.hasExpire()) {
+        batch->Put(expireKey(meta.expire, rec.key), "");
+    } else if (rec.op == BinlogDelete && versioned_) {
+        batch->Put(expireKey(ValueMeta::timeFromTs(meta.ts), rec.key, 'd'), "");
+    }
+    return Status();
+}
+
+Status LogDb::rebuildIndexes(int64_t* n, int64_t* removed) {
+    Status st;
+    for (auto& def: indexes_.defs) {
+        unique_ptr<leveldb::Iterator> it(db_->NewIterator(leveldb::ReadOptions()));
+        leveldb::WriteBatch batch;
+        string t, blob;
+        int staged = 0;
+        for (it->Seek(def.prefix); st.ok() && it->Valid() && convSlice(it->key()).starts_with(def.prefix); it->Next()) {
+            Slice v;
+            if (isMetaKey(convSlice(it->key())) || !resolveValue(convSlice(it->value()), &v, &blob).ok()
+                || !def.term(convSlice(it->key()), v, &t)) {
+                continue;
+            }
+            batch.Put(def.entryKey(t, convSlice(it->key())), "");
+            ++*n;
+            if (++staged >= 1000) {
+                st = (ConvertStatus)db_->Write(leveldb::WriteOptions(), &batch);
+                batch.Clear();
+                staged = 0;
+            }
+        }
+        //entries left by earlier writes whose key no longer has the term, index-get only skips them
+        string pre = def.entryPrefix(), stored;
+        Slice et, key;
+        for (it->Seek(pre); st.ok() && it->Valid() && convSlice(it->key()).starts_with(pre); it->Next()) {
+            if (!def.decodeEntry(convSlice(it->key()), &et, &key)) {
+                continue;
+            }
+            Slice v;
+            leveldb::Status s = db_->Get(leveldb::ReadOptions(), convSlice(key), &stored);
+            if (!s.ok() && !s.IsNotFound()) {
+                st = ConvertStatus(s);
+                break;
+            } else if (s.ok() && resolveValue(stored, &v, &blob).ok() && def.term(key, v, &t) && Slice(t) == et) {
+                continue;
+            }
+            batch.Delete(it->key());
+            ++*removed;
+            if (++staged >= 1000) {
+                st = (ConvertStatus)db_->Write(leveldb::WriteOptions(), &batch);
+                batch.Clear();
+                staged = 0;
+            }
+        }
+        if (st.ok() && staged) {
+            st = (ConvertStatus)db_->Write(leveldb::WriteOptions(), &batch);
+        }
+        info("index %s rebuilt, %ld entries in total, %ld stale entries removed %s",
+            def.name.c_str(), (long)*n, (long)*removed, st.toString().c_str());
+        if (!st.ok()) {
+            break;
+        }
+    }
+    return st;
+}
+
+//expire index entry, stale entries of rewritten keys are skipped by removeExpired.
+//kind 'd' is the entry of a deleted mark written at tm, for purgeDeleted
+string LogDb::expireKey(int64_t tm, Slice key, char kind) {
+    string k = string(META_KEY_PREFIX) + kind;
+    for (int i = 7; i >= 0; i --) { //big endian keeps entries in time order
+        k += (char)(tm >> (i*8));
+    }
+    k.append(key.data(), key.size());
+    return k;
+}
+
+Slice LogDb::decodeExpireKey(Slice entry, int64_t* tm) {
+    size_t pre = strlen(META_KEY_PREFIX) + 1;
+    *tm = 0;
+    for (size_t i = pre; i < pre + 8 && i < entry.size(); i ++) {
+        *tm = (*tm << 8) | (unsigned char)entry[i];
+    }
+    return entry.size() > pre + 8 ? entry.sub(pre + 8) : Slice();
+}
+
+void LogDb::refreshLevel0() {
+    string v;
+    if (db_->GetProperty("leveldb.num-files-at-level0", &v)) {
+        level0_ = util::atoi(v.c_str());
+    }
+}
+
+int LogDb::writeDelay() {
+    int excess = level0_ - g_level0_slowdown;
+    return g_level0_slowdown > 0 && excess >= 0 ? excess + 1 : 0; //1ms more for each level0 file above slowdown
+}
+
+Status LogDb::gcBlobs(int64_t limit) {
+    BlobGc& gc = blobGc_;
+    time_t now = time(NULL);
+    for (auto p = gc.obsolete.begin(); p != gc.obsolete.end(); ) {
+        if (now - p->second >= blobGcInterval_) {
+            blobs_.remove(p->first);
+            gc.obsolete.erase(p++);
+        } else {
+            ++p;
+        }
+    }
+    if (gc.fileno < 0) {
+        for (int64_t f: blobs_.closedFiles()) {
+            if (f > gc.lastChecked && !gc.obsolete.count(f)) {
+                gc.fileno = f;
+                break;
+            }
+        }
+        if (gc.fileno < 0) {
+            if (now - gc.passStart >= blobGcInterval_) {
+                gc.lastChecked = 0;
+                gc.passStart = now;
+            }
+            return Status();
+        }
+        gc.offset = gc.total = gc.live = 0;
+        gc.rewriting = false;
+    }
+    leveldb::WriteBatch batch;
+    string key, value, stored, scratch;
+    Status st;
+    int64_t begin = gc.offset, moved = 0;
+    while (gc.offset - begin < limit) {
+        int64_t voff = 0;
+        st = blobs_.readRecord(gc.fileno, &gc.offset, &key, &voff, &value);
+        if (!st.ok() || key.empty()) {
+            break;
+        }
+        gc.total += value.size();
+        leveldb::Status s = db_->Get(leveldb::ReadOptions(), key, &stored);
+        ValueMeta meta;
+        Slice v;
+        if (!s.ok() || !ValueMeta::decode(stored, &meta, &v) || !meta.hasBlob()
+            || meta.blobFile != gc.fileno || meta.blobOffset != voff) {
+            continue;
+        }
+        gc.live += value.size();
+        if (gc.rewriting) {
+            int64_t fileno = 0, offset = 0;
+            st = blobs_.append(key, value, &fileno, &offset);
+            if (!st.ok()) {
+                break;
+            }
+            meta.setBlob(fileno, offset, value.size());
+            batch.Put(key, convSlice(meta.encode("", &scratch)));
+            moved += value.size();
+        }
+    }
+    if (moved) {
+        st = blobs_.sync();
+        if (st.ok()) {
+            st = (ConvertStatus)db_->Write(leveldb::WriteOptions(), &batch);
+        }
+    }
+    if (!st.ok()) {
+        error("gc blob file %ld failed %s", (long)gc.fileno, st.toString().c_str());
+        gc.lastChecked = gc.fileno;
+        gc.fileno = -1;
+        return st;
+    }
+    if (key.empty()) { //end of file
+        if (gc.rewriting) {
+            info("blob file %ld rewritten, %ld live bytes moved", (long)gc.fileno, (long)gc.live);
+            gc.obsolete[gc.fileno] = now;
+        } else if (gc.total - gc.live >= gc.total * blobGcPercent_ / 100 && gc.total) {
+            info("blob file %ld garbage %ld of %ld bytes, rewriting", (long)gc.fileno, (long)(gc.total - gc.live), (long)gc.total);
+            gc.rewriting = true;
+            gc.offset = gc.total = gc.live = 0;
+            return st;
+        }
+        gc.lastChecked = gc.fileno;
+        gc.fileno = -1;
+    }
+    return st;
+}
+
+//ids of the default keyspace and the configured ones, swept in this order
+vector<int> LogDb::keyspaceIds_() {
+    vector<int> ids(1, 0);
+    for (Keyspace* ks: keyspaces_.all()) {
+        ids.push_back(ks->id);
+    }
+    return ids;
+}
+
+Status LogDb::removeExpired(int limit) {
+    Status st;
+    for (int ks: keyspaceIds_()) {
+        int n = 0;
+        st = removeExpired_(ks, limit, &n);
+        limit -= n;
+        if (!st.ok() || limit <= 0) {
+            break;
+        }
     }
-    Status st = Status::fromFormat(EINVAL, "unknown op in LogRecord %d", rec.op);
-    error("%s", st.toString().c_str());
+    return st;
+}
+
+Status LogDb::removeExpired_(int ks, int limit, int* scanned) {
+    time_t now = time(NULL);
+    string bkey = expireKey(0, ""), ekey = expireKey(now+1, "");
+    leveldb::DB* ldb = getdb(ks);
+    unique_ptr<leveldb::Iterator> it(ldb->NewIterator(leveldb::ReadOptions()));
+    leveldb::WriteBatch batch;
+    string stored, data, mark, scratch;
+    vector<string> keys; //removed keys, their range hashes are dropped after the write
+    Status st;
+    int n = 0, removed = 0;
+    for (it->Seek(bkey); st.ok() && it->Valid() && it->key().compare(ekey) < 0 && n < limit; it->Next(), n++) {
+        batch.Delete(it->key());
+        int64_t tm = 0;
+        Slice key = decodeExpireKey(convSlice(it->key()), &tm);
+        leveldb::Status s = ldb->Get(leveldb::ReadOptions(), convSlice(key), &stored);
+        if (s.IsNotFound()) {
+            continue;
+        } else if (!s.ok()) {
+            st = ConvertStatus(s);
+            break;
+        }
+        ValueMeta meta;
+        Slice v;
+        if (!ValueMeta::decode(stored, &meta, &v) || !meta.hasExpire() || meta.expire != tm) {
+            continue;
+        }
+        LogRecord rec(dbid_, now, key, "", BinlogDelete, ks);
+        if (versioned_) {
+            rec.value = ValueMeta(clock_.now(), dbid_, true).encode("", &mark);
+        }
+        if (binlogDir_.size()) {
+            st = rec.encodeRecord(&data);
+            if (st.ok()) {
+                st = appendLog_(data);
+            }
+        }
+        if (st.ok()) {
+            st = stageRecord_(rec, &batch, &scratch);
+            keys.push_back(key);
+            removed ++;
+        }
+    }
+    if (removed && binlogDir_.size()) {
+        notifySlaves_();
+    }
+    if (st.ok() && n) {
+        st = (ConvertStatus)ldb->Write(leveldb::WriteOptions(), &batch);
+        info("expire index of keyspace %d %d entries scanned %d keys removed %s", ks, n, removed, st.toString().c_str());
+    }
+    if (st.ok() && removed) {
+        for (auto& k: keys) {
+            if (!ks) {
+                rangeHashes_.invalidate(k);
+            }
+        }
+        setApplied_();
+    }
+    *scanned = n;
+    return st;
+}
+
+Status LogDb::purgeDeleted(int limit) {
+    if (!versioned_ || tombstoneTtl_ <= 0) {
+        return Status();
+    }
+    Status st;
+    for (int ks: keyspaceIds_()) {
+        int n = 0;
+        st = purgeDeleted_(ks, limit, &n);
+        limit -= n;
+        if (!st.ok() || limit <= 0) {
+            break;
+        }
+    }
+    return st;
+}
+
+Status LogDb::purgeDeleted_(int ks, int limit, int* scanned) {
+    time_t now = time(NULL);
+    string bkey = expireKey(0, "", 'd'), ekey = expireKey(now - tombstoneTtl_ + 1, "", 'd');
+    leveldb::DB* ldb = getdb(ks);
+    unique_ptr<leveldb::Iterator> it(ldb->NewIterator(leveldb::ReadOptions()));
+    leveldb::WriteBatch batch;
+    string stored;
+    Status st;
+    int n = 0, purged = 0;
+    for (it->Seek(bkey); it->Valid() && it->key().compare(ekey) < 0 && n < limit; it->Next(), n++) {
+        batch.Delete(it->key());
+        int64_t tm = 0;
+        Slice key = decodeExpireKey(convSlice(it->key()), &tm);
+        leveldb::Status s = ldb->Get(leveldb::ReadOptions(), convSlice(key), &stored);
+        if (s.IsNotFound()) {
+            continue;
+        } else if (!s.ok()) {
+            st = ConvertStatus(s);
+            break;
+        }
+        ValueMeta meta;
+        Slice v;
+        //a key written again after the delete keeps its value, the mark of a later delete has its own entry
+        if (ValueMeta::decode(stored, &meta, &v) || ValueMeta::timeFromTs(meta.ts) != tm) {
+            continue;
+        }
+        batch.Delete(convSlice(key));
+        purged ++;
+    }
+    if (st.ok() && n) {
+        st = (ConvertStatus)ldb->Write(leveldb::WriteOptions(), &batch);
+        info("deleted marks of keyspace %d %d entries scanned %d marks purged %s", ks, n, purged, st.toString().c_str());
+    }
+    *scanned = n;
     return st;
 }
 
 Status LogDb::operateLog_(Slice data) {
+    Status s = appendLog_(data);
+    notifySlaves_();
+    return s;
+}
+
+Status LogDb::appendLog_(Slice data) {
     Status s = checkCurLog_();
+    int64_t tm = LogRecord::timeOf(data);
+    int64_t offset = -1, start = s.ok() ? curLog_->size() : 0;
+    if (s.ok() && tm >= tindex_.lastTime_ + indexInterval_) {
+        offset = start;
+    }
     if (s.ok()) {
         s = curLog_->append(data);
     }
+    if (s.ok()) {
+        tail_.append(lastFile_, start, data);
+    }
+    if (s.ok() && offset >= 0) {
+        s = tindex_.add(tm, offset);
+    }
+    return s;
+}
+
+Status LogDb::findBinlogPos(const string& dir, int64_t tm, int64_t* fileno, int64_t* offset, int64_t endno, int64_t endoff) {
+    vector<string> files;
+    Status st = file::getChildren(dir, &files);
+    if (!st.ok()) {
+        return st;
+    }
+    vector<int64_t> logs;
+    for (auto& f: files) {
+        int64_t n = FileName::binlogNum(f);
+        if (n && (endno < 0 || n <= endno)) {
+            logs.push_back(n);
+        }
+    }
+    if (logs.empty()) {
+        return Status::fromFormat(ENOENT, "no binlog in %s", dir.c_str());
+    }
+    sort(logs.begin(), logs.end());
+    //the last file beginning not later than tm, and the indexed offset in it to scan from.
+    //a file with an indexed time later than tm holds the position even if a later file begins earlier
+    *fileno = logs[0];
+    *offset = 0;
+    string scratch;
+    Slice rec;
+    for (int64_t no: logs) {
+        int64_t off = 0, first = 0, last = 0;
+        Status s2 = TimeIndex::find(dir+FileName::timeIndexFile(no), tm, &off, &first, &last);
+        if (!s2.ok() || first == 0) { //file written before time index, or index lost
+            LogFile lf;
+            int64_t o = 0;
+            off = last = 0;
+            if (lf.open(dir+FileName::binlogFile(no)).ok() && lf.getRecord(&o, &rec, &scratch).ok() && rec.size()) {
+                first = LogRecord::timeOf(rec);
+            }
+        }
+        if (first == 0) {
+            continue;
+        }
+        if (first > tm) {
+            break;
+        }
+        *fileno = no;
+        *offset = off;
+        if (last > tm) {
+            break;
+        }
+    }
+    LogFile lf;
+    st = lf.open(dir+FileName::binlogFile(*fileno));
+    for (int64_t o = *offset; st.ok(); *offset = o) {
+        if (*fileno == endno && endoff >= 0 && o >= endoff) {
+            break;
+        }
+        st = lf.getRecord(&o, &rec, &scratch);
+        if (!st.ok() || rec.empty() || LogRecord::timeOf(rec) > tm) {
+            break;
+        }
+    }
+    info("binlog position at %ld in %s is %ld %ld %s", (long)tm, dir.c_str(), (long)*fileno, (long)*offset, st.toString().c_str());
+    return st;
+}
+
+Status LogDb::findBinlogPosLock(int64_t tm, int64_t* fileno, int64_t* offset) {
+    int64_t endno = 0, endoff = 0;
+    {
+        lock_guard<mutex> lk(*this);
+        endno = lastFile_;
+        endoff = curLog_ ? curLog_->size() : 0;
+    }
+    return findBinlogPos(binlogDir_, tm, fileno, offset, endno, endoff);
+}
+
+void LogDb::notifySlaves_() {
     vector<HttpConnPtr> conns = removeSlaveConnsLock();
+    if (conns.size() > 1) {
+        lock_guard<mutex> lk(*this);
+        shared_.on = true;
+        shared_.nfile = -1;
+    }
     for (auto& con: conns) {
         EventBase* base = con->getBase();
-        if (base) {
+        if (base && Slice(con.getRequest().uri).starts_with("/cdc/")) {
+            handleCdc(this, base, con);
+        } else if (base) {
             handleBinlog(this, base, con);
         } else {
             error("connection closed, but sending response in operateLog");
         }
     }
-    return s;
+    if (conns.size() > 1) {
+        lock_guard<mutex> lk(*this);
+        shared_.on = false;
+        shared_.data.clear();
+    }
 }
 
-Status LogDb::saveSlave_() {
+Status LogDb::saveSlave_(SlaveStatus& ss) {
     string cont = util::format("%s #host\n%d #port\n%s",
-        slaveStatus_.host.c_str(), slaveStatus_.port, slaveStatus_.pos.toLines().c_str());
-    string fname = dbdir_ + FileName::slaveFile();
+        ss.host.c_str(), ss.port, ss.pos.toLines().c_str());
+    if (ss.startTime > 0 && ss.pos.fileno < 0) {
+        cont += util::format("%ld #start time\n", (long)ss.startTime);
+    }
+    string fname = dbdir_ + ss.file;
     Status st = file::renameSave(fname, fname+".tmp", cont);
     if (!st.ok()) {
         error("save slave status failed %s", st.toString().c_str());
         return st;
     }
-    info("save slave staus ok '%s'", slaveStatus_.pos.toString().c_str());
-    slaveStatus_.changed = false;
-    slaveStatus_.lastSaved = time(NULL);
+    info("save slave staus %s ok '%s'", ss.file.c_str(), ss.pos.toString().c_str());
+    ss.changed = false;
+    ss.lastSaved = time(NULL);
     return Status();
 }
 
-Status LogDb::fetchLogLock(int64_t* fileno, int64_t* offset, string* data, const HttpConnPtr& con) {
+//append records of raw matching filter to data
+static Status filterRecords(Slice raw, const KeyFilter& filter, string* data) {
+    Slice record;
+    LogRecord rec;
+    Status st;
+    while (raw.size() && (st=LogFile::decodeBinlogData(&raw, &record), st.ok())) {
+        st = LogRecord::decodeRecord(record, &rec);
+        if (!st.ok()) {
+            break;
+        }
+        if (filter.match(rec.key)) {
+            data->append(record.data() - 16, LogFile::totalLen(record.size()));
+        }
+    }
+    return st;
+}
+
+Status LogDb::fetchLogLock(int64_t* fileno, int64_t* offset, string* data, const HttpConnPtr& con, const KeyFilter& filter) {
     if (binlogDir_.empty()) {
         return Status::fromFormat(EINVAL, "binlog dir empty");
     }
@@ -381,21 +1169,55 @@ Status LogDb::fetchLogLock(int64_t* fileno, int64_t* offset, string* data, const
             *fileno, *offset, lastFile_, curLog_->size());
         return Status::fromFormat(EINVAL, "file offset not valid");
     }
-    Status st = getLog_(*fileno, *offset, data);
-    if (!st.ok()) { //error
-        error("db get log failed");
-        return st;
+    if (shared_.on && shared_.nfile >= 0 && shared_.fileno == *fileno && shared_.offset == *offset && shared_.spec == filter.spec) {
+        *data = shared_.data;
+        *fileno = shared_.nfile;
+        *offset = shared_.noff;
+        sharedFetches_ ++;
+        return Status();
     }
-    if (data->empty()) {
-        ++*fileno;
-        *offset = 0;
-    } else {
-        *offset += data->size();
+    int64_t fileno0 = *fileno, offset0 = *offset;
+    //skipped stretches are read on up to 4 batches under lock, then the advanced position is returned alone
+    Status st;
+    int64_t scanned = 0;
+    static thread_local string raw; //buffer of file reads, kept for the next fetch of this thread
+    do {
+        raw.clear();
+        st = getLog_(*fileno, *offset, &raw);
+        if (!st.ok()) { //error
+            error("db get log failed");
+            return st;
+        }
+        if (raw.empty()) {
+            if (scanned == 0) {
+                ++*fileno;
+                *offset = 0;
+            }
+            break;
+        }
+        *offset += raw.size();
+        scanned += raw.size();
+        if (filter.empty()) {
+            data->assign(raw);
+        } else {
+            st = filterRecords(raw, filter, data);
+        }
+    } while (st.ok() && data->empty() && scanned < 4 * (int64_t)g_batch_size);
+    if (st.ok() && shared_.on && shared_.nfile < 0) {
+        shared_.fileno = fileno0;
+        shared_.offset = offset0;
+        shared_.nfile = *fileno;
+        shared_.noff = *offset;
+        shared_.spec = filter.spec;
+        shared_.data = *data;
     }
-    return Status();
+    return st;
 }
 
 Status LogDb::getLog_(int64_t fileno, int64_t offset, string* rec) {
+    if (tail_.enabled() && tail_.read(fileno, offset, g_batch_size, rec)) {
+        return Status();
+    }
     LogFile nf;
     LogFile* lf = NULL;
     Status st;
@@ -411,16 +1233,91 @@ Status LogDb::getLog_(int64_t fileno, int64_t offset, string* rec) {
     return st;
 }
 
-Status LogDb::updateSlaveStatusLock(SyncPos pos) {
+Status LogDb::updateSlaveStatusLock(size_t idx, SyncPos pos) {
     lock_guard<mutex> lk(*this);
-    SlaveStatus& ss = slaveStatus_;
+    SlaveStatus& ss = slaves_.at(idx);
     if (pos != ss.pos) {
         ss.pos = pos;
         ss.changed = true;
+        slaveSynced_.notify_all();
         time_t now = time(NULL);
         if (now - ss.lastSaved > g_flush_slave_interval) {
-            return saveSlave_();
+            return saveSlave_(ss);
         }
     }
     return Status();
-}
\ No newline at end of file
+}
+
+void LogDb::addSyncStatsLock(size_t idx, int64_t records, int64_t bytes, time_t lag, int masterDbid) {
+    lock_guard<mutex> lk(*this);
+    SlaveStatus& ss = slaves_.at(idx);
+    ss.records += records;
+    ss.bytes += bytes;
+    ss.lag = lag;
+    ss.masterDbid = masterDbid;
+}
+
+Status LogDb::waitSyncedLock(int dbid, int64_t fileno, int64_t offset, int waitMs, SlaveStatus* master) {
+    unique_lock<mutex> lk(*this);
+    SlaveStatus* ss = NULL;
+    for (auto& s: slaves_) {
+        if (s.masterDbid == dbid) {
+            ss = &s;
+        }
+    }
+    if (ss == NULL) {
+        return Status::fromFormat(ENOENT, "db %d not followed", dbid);
+    }
+    bool r = slaveSynced_.wait_for(lk, chrono::milliseconds(waitMs), [=]{ return ss->pos.reached(fileno, offset); });
+    *master = *ss;
+    return r ? Status() : Status::fromFormat(ETIMEDOUT, "behind db %d %ld %ld", dbid, fileno, offset);
+}
+
+void LogDb::setApplied_() {
+    if (curLog_) {
+        lock_guard<mutex> lk(*this);
+        appliedFile_ = lastFile_;
+        appliedOffset_ = curLog_->size();
+    }
+}
+
+string LogDb::appliedPosLock() {
+    lock_guard<mutex> lk(*this);
+    if (binlogDir_.empty() || appliedFile_ == 0) {
+        return "";
+    }
+    return util::format("%d %ld %ld", dbid_, (long)appliedFile_, (long)appliedOffset_);
+}
+
+void LogDb::holdSync(size_t idx, bool hold) {
+    if (hold) {
+        syncHolds_[idx];
+        return;
+    }
+    auto p = syncHolds_.find(idx);
+    if (p == syncHolds_.end()) {
+        return;
+    }
+    vector<Task> parked;
+    parked.swap(p->second);
+    syncHolds_.erase(p);
+    for (auto& t: parked) {
+        t();
+    }
+}
+
+bool LogDb::parkSync(size_t idx, const Task& apply) {
+    auto p = syncHolds_.find(idx);
+    if (p == syncHolds_.end()) {
+        return false;
+    }
+    p->second.push_back(apply);
+    return true;
+}
+
+string LogDb::binlogPos() {
+    if (binlogDir_.empty() || curLog_ == NULL) {
+        return "";
+    }
+    return util::format("%d %ld %ld", dbid_, lastFile_, curLog_->size());
+}
@@ -6,10 +6,22 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <condition_variable>
+#include <atomic>
 #include "leveldb/db.h"
 #include "leveldb/env.h"
+#include "leveldb/write_batch.h"
 #include "globals.h"
 #include "logfile.h"
+#include "value-meta.h"
+#include "scan-session.h"
+#include "blob-store.h"
+#include "hot-keys.h"
+#include "range-hash.h"
+#include "key-filter.h"
+#include "binlog-tail.h"
+#include "keyspace.h"
+#include "secondary-index.h"
 
 struct FileName {
     static string binlogPrefix() { return "binlog-"; }
@@ -18,6 +30,11 @@ struct FileName {
     static string binlogFile(int64_t no) { return binlogPrefix().data()+util::format("%05d", no); }
     static string closedFile() { return "dbclosed.txt"; }
     static string slaveFile() { return "slave-status"; }
+    static string timeIndexFile(int64_t no) { return "tindex-"+util::format("%05ld", (long)no); }
+    //slave-status, slave-status.<name> ... one file for each master followed
+    static bool isSlaveFile(const string& name) {
+        return name == slaveFile() || (Slice(name).starts_with(slaveFile()+".") && !Slice(name).end_with(".tmp"));
+    }
 };
 
 enum BinlogOp { BinlogWrite=1, BinlogDelete, };
@@ -37,52 +54,182 @@ struct LogRecord {
     Slice key;
     Slice value;
     BinlogOp op;
-    LogRecord():dbid(0),tm(0) {}
-    LogRecord(int dbid1, time_t tm1, Slice key1, Slice value1, BinlogOp op1): dbid(dbid1),tm(tm1), key(key1), value(value1), op(op1) {}
+    int ks; //keyspace id, encoded in the high bits of op so records of the default keyspace are unchanged
+    LogRecord():dbid(0),tm(0),ks(0) {}
+    LogRecord(int dbid1, time_t tm1, Slice key1, Slice value1, BinlogOp op1, int ks1=0): dbid(dbid1),tm(tm1), key(key1), value(value1), op(op1), ks(ks1) {}
     Status encodeRecord(string* data);
     static Status decodeRecord(Slice data, LogRecord* rec);
+    //version carried in value, or made from tm and dbid for records without one
+    ValueMeta decodeValue(Slice* value) const;
+    //tm of an encoded record
+    static int64_t timeOf(Slice data) { int64_t tm = 0; if (data.size() >= 12) { memcpy(&tm, data.data()+4, 8); } return tm; }
 };
 
 struct SlaveStatus {
+    string file;
     string host;
     int port;
+    int masterDbid; //dbid reported by master, -1 before first response
     SyncPos pos;
     time_t lastSaved;
     bool changed;
-    SlaveStatus():port(-1), lastSaved(time(NULL)), changed(0) {}
-    bool isValid() { return pos.offset != -1; }
+    int64_t records; //records applied from this master
+    int64_t bytes;
+    time_t lag; //seconds the last applied record is behind, 0 when caught up
+    time_t startTime; //follow master from binlog at this time, used while pos.fileno is -1
+    SlaveStatus():port(-1), masterDbid(-1), lastSaved(time(NULL)), changed(0), records(0), bytes(0), lag(0), startTime(0) {}
+    bool isValid() { return pos.offset != -1 || startTime > 0; }
+};
+
+//progress of blob garbage collection, advanced a little in each gcBlobs call.
+//a closed file is first scanned to count live bytes, and rewritten if garbage is enough
+struct BlobGc {
+    int64_t fileno; //file being collected, -1 if none
+    int64_t offset, total, live;
+    bool rewriting;
+    int64_t lastChecked; //files up to it are checked in this pass
+    time_t passStart;
+    map<int64_t, time_t> obsolete; //rewritten files, removed an interval later when no reader uses them
+    BlobGc(): fileno(-1), offset(0), total(0), live(0), rewriting(false), lastChecked(0), passStart(0) {}
 };
 
 struct LogDb: public mutex {
-    LogDb():dbid_(-1), binlogSize_(0), lastFile_(0), curLog_(NULL), db_(NULL) {  }
+    LogDb():dbid_(-1), binlogSize_(0), lastFile_(0), appliedFile_(0), appliedOffset_(0), curLog_(NULL), indexInterval_(1), db_(NULL), versioned_(false), tombstoneTtl_(0), casOk_(0), casFail_(0), level0_(0),
+        blobThreshold_(0), blobGcPercent_(50), blobGcInterval_(3600), cdcEvents_(0), sharedFetches_(0) {  }
     Status init(Conf& conf);
     leveldb::DB* getdb() { return db_; }
-    Status write(Slice key, Slice value);
-    Status remove(Slice key);
-    Status applyLog(Slice record);
+    //leveldb of keyspace ks, NULL if it is not configured
+    leveldb::DB* getdb(int ks) { Keyspace* k = ks ? keyspaces_.byId(ks) : NULL; return ks ? (k ? k->db : NULL) : db_; }
+    //expire is the unix time the key expires, 0 for never. ks is the keyspace id
+    Status write(Slice key, Slice value, time_t expire=0, int ks=0);
+    Status remove(Slice key, int ks=0);
+    //apply records from master in one leveldb write, sync makes the batch durable before return
+    Status applyLogs(vector<LogRecord>& recs, bool sync);
+    //ENOENT if key not exists
+    Status get(const leveldb::ReadOptions& options, Slice key, string* value, int ks=0);
+    //value of stored read from blob file if needed, ENOENT if it is a deleted mark or expired
+    Status resolveValue(Slice stored, Slice* value, string* scratch);
+    //stored with blob value inlined, for slaves syncing data
+    Status rawValue(Slice stored, Slice* raw, string* scratch);
+    //false if the stored value is a deleted mark or expired. value is empty for blob values
+    static bool decodeValue(Slice stored, Slice* value) {
+        ValueMeta meta;
+        return ValueMeta::decode(stored, &meta, value) && !meta.expired(time(NULL));
+    }
+    //read-modify-write ops, called in write thread so no other write interleaves.
+    //the binlog gets the resulting value. expire -1 keeps the current ttl of key
+    //incr treats a missing key as 0, EINVAL if current value is not an integer
+    Status incr(Slice key, int64_t delta, time_t expire, int64_t* result);
+    //expect NULL means key must not exist. ECANCELED if current value differs
+    Status cas(Slice key, const Slice* expect, Slice value, time_t expire);
+    Status append(Slice key, Slice value, time_t expire, size_t* len);
+    //cache leveldb.num-files-at-level0, called in a timer
+    void refreshLevel0();
+    //ms a client write is delayed before it is queued when level0 files pile up, so leveldb does not stall the write thread
+    int writeDelay();
+    //collect garbage in blob files, reading up to limit bytes. called in write thread
+    Status gcBlobs(int64_t limit);
+    //delete up to limit expired keys of all keyspaces, one batch for each. called in write thread
+    Status removeExpired(int limit);
+    //remove up to limit deleted marks older than tombstoneTtl_ of all keyspaces, without binlog. called in write thread
+    Status purgeDeleted(int limit);
+    //add index entries of existing keys, for indexes configured after the keys were written,
+    //and remove entries whose key no longer has the term. called in write thread
+    Status rebuildIndexes(int64_t* n, int64_t* removed);
     ~LogDb();
     vector<HttpConnPtr> removeSlaveConnsLock() { lock_guard<mutex> lk(*this); return move(slaveConns_); }
-    SlaveStatus getSlaveStatusLock() { lock_guard<mutex> lk(*this); return slaveStatus_; }
-    Status updateSlaveStatusLock(SyncPos pos);
-    Status fetchLogLock(int64_t* fileno, int64_t* offset, string* data, const HttpConnPtr& con);
+    SlaveStatus getSlaveStatusLock(size_t idx) {
+        lock_guard<mutex> lk(*this);
+        return idx < slaves_.size() ? slaves_[idx] : SlaveStatus();
+    }
+    Status updateSlaveStatusLock(size_t idx, SyncPos pos);
+    void addSyncStatsLock(size_t idx, int64_t records, int64_t bytes, time_t lag, int masterDbid);
+    //wait until binlog of master dbid is applied to fileno/offset.
+    //ENOENT if dbid is not followed, ETIMEDOUT if still behind, master is filled in both cases
+    Status waitSyncedLock(int dbid, int64_t fileno, int64_t offset, int waitMs, SlaveStatus* master);
+    //position after the last record written, called in write thread
+    string binlogPos();
+    //position before which all records are written to leveldb as well, empty if binlog is off.
+    //taken before a snapshot, the snapshot holds every record before it
+    string appliedPosLock();
+    //sync batches of channel idx are parked instead of applied while it is held, and applied in order when released.
+    //anti-entropy holds the channel while a repair page is fetched and applied. called in write thread
+    void holdSync(size_t idx, bool hold);
+    //false if channel idx is not held
+    bool parkSync(size_t idx, const Task& apply);
+    //position in binlog of dir before the first record later than tm, records after it may be earlier than tm
+    //when they are not in time order. files after endno and bytes of endno from endoff are not read, -1 for no limit
+    static Status findBinlogPos(const string& dir, int64_t tm, int64_t* fileno, int64_t* offset, int64_t endno=-1, int64_t endoff=-1);
+    //the end of binlog is taken under lock, files are read without it
+    Status findBinlogPosLock(int64_t tm, int64_t* fileno, int64_t* offset);
+    //records after fileno/offset matching filter. the position advances over skipped records,
+    //data may be empty with the position advanced when nothing matched
+    Status fetchLogLock(int64_t* fileno, int64_t* offset, string* data, const HttpConnPtr& con, const KeyFilter& filter);
     static Status dumpFile(const string& name);
 
 
-    SlaveStatus slaveStatus_;
+    vector<SlaveStatus> slaves_; //masters this db follows
+    condition_variable slaveSynced_;
     string binlogDir_, dbdir_;
     int dbid_;
     int binlogSize_;
     int64_t lastFile_;
+    int64_t appliedFile_, appliedOffset_; //see appliedPosLock
     LogFile* curLog_;
+    TimeIndex tindex_; //time index of curLog_
+    int indexInterval_;
     leveldb::DB* db_;
     vector<HttpConnPtr> slaveConns_;
+    ScanSessions scans_;
+    bool versioned_; //values stored with version, last writer wins
+    int tombstoneTtl_; //seconds deleted marks are kept, older writes arriving later bring the key back
+    HybridClock clock_;
+    atomic<int64_t> casOk_, casFail_;
+    atomic<int> level0_;
+    BlobStore blobs_;
+    int64_t blobThreshold_; //values not smaller than it go to blob files, 0 to disable
+    int blobGcPercent_;
+    int blobGcInterval_;
+    BlobGc blobGc_;
+    HotKeys hotKeys_;
+    Warmup warmup_; //fed by hotKeys_ with sampled reads
+    Keyspaces keyspaces_;
+    SecondaryIndexes indexes_;
+    RangeHashes rangeHashes_;
+    BinlogTail tail_; //recent binlog shared by slaves and cdc readers
+    atomic<int64_t> cdcEvents_;
+    //batch fetched for the first reader woken by a write, reused by the others waiting at the same position
+    struct SharedFetch {
+        bool on;
+        int64_t fileno, offset, nfile, noff;
+        string spec, data;
+        SharedFetch(): on(false), fileno(-1), offset(-1), nfile(-1), noff(-1) {}
+    };
+    SharedFetch shared_;
+    atomic<int64_t> sharedFetches_;
+    map<size_t, vector<Task>> syncHolds_; //held channels and their parked batches, used in write thread
 
     Status getLog_(int64_t fileno, int64_t offset, string* rec);
-    Status saveSlave_();
+    //records in binlog are all written to leveldb, called in write thread after a write
+    void setApplied_();
+    Status saveSlave_(SlaveStatus& ss);
     Status checkCurLog_();
-    Status applyRecord_(LogRecord& rec);
+    Status applyRecord_(LogRecord& rec, time_t expire=0);
+    Status getCurrent_(Slice key, string* value, time_t* expire);
     Status operateDb_(LogRecord& rec);
+    //staged keeps the values of indexed keys staged in the same batch, NULL if the batch has only one record of a key
+    Status stageRecord_(LogRecord& rec, leveldb::WriteBatch* batch, string* scratch, map<string, pair<bool, string>>* staged=NULL);
+    static string expireKey(int64_t tm, Slice key, char kind='e');
+    static Slice decodeExpireKey(Slice entry, int64_t* tm);
+    vector<int> keyspaceIds_();
+    //scanned is set to the expire entries read
+    Status removeExpired_(int ks, int limit, int* scanned);
+    Status purgeDeleted_(int ks, int limit, int* scanned);
     Status operateLog_(Slice data);
+    Status appendLog_(Slice data);
+    void notifySlaves_();
     Status loadLogs_();
-    Status loadSlave_();
+    Status loadSlaves_();
+    Status loadSlave_(const string& name);
+    Status resolveConflicts_(vector<LogRecord>& recs);
 };
@@ -3,6 +3,7 @@
 #include <handy/net.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <memory>
 
 Status LogFile::open(const string& name, bool readonly) {
@@ -24,15 +25,17 @@ Status LogFile::open(const string& name, bool readonly) {
 }
 
 Status LogFile::append(Slice record) {
-    int padded = totalLen(record.size());
-    char* p = new char[padded];
-    memset(p, 0, padded);
-    unique_ptr<char> rel1(p);
-    memcpy(p, &LOG_MAGIC, 8);
-    *(size_t*)(p+8) = record.size();
-    memcpy(p+16, record.data(), record.size());
-    int w = ::write(fd_, p, padded);
-    if (w != padded) {
+    static const char zeros[8] = {0};
+    int64_t head[2] = { LOG_MAGIC, (int64_t)record.size() };
+    size_t padded = totalLen(record.size());
+    //header, record and padding written together without building the frame in a buffer
+    struct iovec iov[3] = {
+        { head, sizeof head },
+        { (void*)record.data(), record.size() },
+        { (void*)zeros, padded - sizeof head - record.size() },
+    };
+    ssize_t w = ::writev(fd_, iov, 3);
+    if (w != (ssize_t)padded) {
         Status st = Status::ioError("write", name_);
         error("%s", st.toString().c_str());
         return st;
@@ -77,16 +80,19 @@ Status LogFile::sync() {
 }
 
 Status LogFile::batchRecord(int64_t offset, string* rec, int batchSize) {
-    char* p = new char[batchSize];
-    unique_ptr<char[]> rel1(p);
+    //read into rec directly, its buffer is reused by callers fetching repeatedly
+    rec->resize(batchSize);
+    char* p = &(*rec)[0];
     int r = pread(fd_, p, batchSize, offset);
     Status st;
     if (r < 0) {
+        rec->clear();
         st = Status::ioError("pread", name_);
         error("logfile batchRecord %s", st.toString().c_str());
         return st;
     }
     if (r == 0) {
+        rec->clear();
         return Status();
     }
     char* pe = p + r;
@@ -99,6 +105,7 @@ Status LogFile::batchRecord(int64_t offset, string* rec, int batchSize) {
         if (magic != LOG_MAGIC || len < 0) {
             error("logfile bad format magic %lx len %ld at %s %ld",
                 magic, len, name_.c_str(), offset+pb-p);
+            rec->clear();
             return Status::fromFormat(EINVAL, "bad format log file %s", name_.c_str());
         }
         int64_t tlen = totalLen(len);
@@ -109,10 +116,10 @@ Status LogFile::batchRecord(int64_t offset, string* rec, int batchSize) {
     }
     if (pb == p) {
         error("log record invalid. readed %ld len %ld batch_size %d", pe-p, len, batchSize);
+        rec->clear();
         return Status::fromFormat(EINVAL, "bad format");
     }
-    rec->clear();
-    rec->append(p, pb);
+    rec->resize(pb - p);
     return Status();
 }
 
@@ -139,3 +146,49 @@ Status LogFile::decodeBinlogData(Slice* fileCont, Slice* record) {
     return Status();
 }
 
+
+Status TimeIndex::open(const string& name) {
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+    name_ = name;
+    lastTime_ = 0;
+    fd_ = ::open(name.c_str(), O_RDWR|O_APPEND|O_CREAT, 0622);
+    if (fd_ < 0) {
+        Status st = Status::ioError("open", name);
+        error("%s", st.toString().c_str());
+        return st;
+    }
+    return Status();
+}
+
+Status TimeIndex::add(int64_t tm, int64_t offset) {
+    int64_t ent[2] = { tm, offset };
+    if (::write(fd_, ent, sizeof ent) != sizeof ent) {
+        Status st = Status::ioError("write", name_);
+        error("%s", st.toString().c_str());
+        return st;
+    }
+    lastTime_ = tm;
+    return Status();
+}
+
+Status TimeIndex::find(const string& name, int64_t tm, int64_t* offset, int64_t* first, int64_t* last) {
+    *offset = 0;
+    *first = *last = 0;
+    string cont;
+    Status st = file::getContent(name, cont);
+    if (!st.ok()) {
+        return st;
+    }
+    const int64_t* ents = (const int64_t*)cont.data();
+    size_t n = cont.size() / 16;
+    if (n) {
+        *first = ents[0];
+        *last = ents[(n-1)*2];
+    }
+    for (size_t i = 0; i < n && ents[i*2] <= tm; i ++) {
+        *offset = ents[i*2+1];
+    }
+    return Status();
+}
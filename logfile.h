@@ -26,6 +26,25 @@ struct LogFile {
     static size_t totalLen(size_t sz) { return (sz + 8 + 8+ 7) / 8 * 8; }
 };
 
+//sparse time index of a binlog file, an entry is added when record time passes the last entry by interval.
+//slaves write records with the time of masters, which may go back, so entry times are a running maximum:
+//records before an entry are earlier than its time, records after it may be earlier too
+//entry format
+// time offset
+// 8    8
+struct TimeIndex {
+    TimeIndex(): fd_(-1), lastTime_(0) {}
+    ~TimeIndex() { if (fd_ >= 0) { close(fd_); } }
+    Status open(const string& name);
+    Status add(int64_t tm, int64_t offset);
+    //offset of the last entry not later than tm, 0 if none. *first and *last are times of the first and last entry, 0 if no entry
+    static Status find(const string& name, int64_t tm, int64_t* offset, int64_t* first, int64_t* last);
+
+    int fd_;
+    string name_;
+    int64_t lastTime_;
+};
+
 struct SyncPos {
     string key;
     int64_t dataFinished;
@@ -57,6 +76,8 @@ struct SyncPos {
         return util::format("%ld #binlog file no\n%ld #binlog offset\n%ld #data file finished flag\n%s #current key\n",
             fileno, offset, dataFinished, key.c_str());
     }
+    //whether binlog data up to fileno/offset of master is applied
+    bool reached(int64_t fno, int64_t off) const { return dataFinished && (fileno > fno || (fileno == fno && offset >= off)); }
     bool operator == (SyncPos& pos) { return key == pos.key && dataFinished == pos.dataFinished && fileno == pos.fileno && offset == pos.offset; }
     bool operator != (SyncPos& pos) { return !operator ==(pos); }
 };
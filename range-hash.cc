@@ -0,0 +1,212 @@
+#include "range-hash.h"
+#include "logdb.h"
+#include "handler.h"
+#include <memory>
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    return x ^ (x >> 33);
+}
+
+void RangeHashes::invalidate_(Slice key) {
+    lock_guard<mutex> lk(mu_);
+    auto it = pieces_.upper_bound(key);
+    if (it != pieces_.begin()) {
+        --it;
+        if (key.compare(it->second.end) < 0) {
+            pieces_.erase(it);
+        }
+    }
+    if (computing_ && !overflow_) {
+        written_.push_back(key);
+        if (written_.size() > 100*1000) {
+            overflow_ = true;
+            written_.clear();
+        }
+    }
+    active_ = pieces_.size() || computing_;
+}
+
+//hash [begin, end) under snapshot, cut into pieces of about pieceSize bytes
+static Status computePieces(LogDb* db, const leveldb::Snapshot* snap, const string& begin, const string& end,
+    int64_t pieceSize, vector<RangeHash>* pieces) {
+    leveldb::ReadOptions options;
+    options.snapshot = snap;
+    options.fill_cache = false;
+    unique_ptr<leveldb::Iterator> it(db->getdb()->NewIterator(options));
+    RangeHash cur;
+    cur.begin = begin;
+    string scratch;
+    Status st;
+    for (it->Seek(begin); it->Valid() && it->key().compare(end) < 0; it->Next()) {
+        Slice k = convSlice(it->key());
+        if (cur.bytes >= pieceSize) {
+            cur.end = k;
+            pieces->push_back(cur);
+            cur = RangeHash();
+            cur.begin = k;
+        }
+        ValueMeta meta;
+        Slice v;
+        ValueMeta::decode(convSlice(it->value()), &meta, &v);
+        st = db->resolveValue(convSlice(it->value()), &v, &scratch);
+        if (st.code() == ENOENT) {
+            continue;
+        } else if (!st.ok()) {
+            return st;
+        }
+        if (meta.hasExpire() && (cur.expireAt == 0 || meta.expire < cur.expireAt)) {
+            cur.expireAt = meta.expire;
+        }
+        cur.hash ^= mix64(fnv1a(k) * 31 + fnv1a(v));
+        cur.count ++;
+        cur.bytes += k.size() + v.size();
+    }
+    st = (ConvertStatus)it->status();
+    cur.end = end;
+    pieces->push_back(cur);
+    return st;
+}
+
+Status hashRange(LogDb* db, const string& begin, const string& end1, int parts, vector<RangeHash>* out) {
+    RangeHashes& rh = db->rangeHashes_;
+    string end = end1.empty() || Slice(end1).compare(META_KEY_PREFIX) > 0 ? string(META_KEY_PREFIX) : end1;
+    //cached pieces inside the range, gaps between them are marked with leaf false
+    vector<RangeHash> segs;
+    time_t now = time(NULL);
+    {
+        lock_guard<mutex> lk(rh.mu_);
+        auto it = rh.pieces_.upper_bound(begin);
+        if (it != rh.pieces_.begin() && Slice(prev(it)->second.end).compare(begin) > 0) {
+            rh.pieces_.erase(prev(it)); //crossing begin
+        }
+        string pos = begin;
+        for (it = rh.pieces_.lower_bound(begin); it != rh.pieces_.end() && it->first < end; ) {
+            RangeHash& p = it->second;
+            if (p.end > end || (p.expireAt && p.expireAt <= now)) {
+                it = rh.pieces_.erase(it);
+                continue;
+            }
+            if (p.begin > pos) {
+                RangeHash gap;
+                gap.begin = pos;
+                gap.end = p.begin;
+                gap.leaf = false;
+                segs.push_back(gap);
+            }
+            segs.push_back(p);
+            pos = p.end;
+            ++it;
+        }
+        if (pos < end) {
+            RangeHash gap;
+            gap.begin = pos;
+            gap.end = end;
+            gap.leaf = false;
+            segs.push_back(gap);
+        }
+        rh.computing_ ++;
+        rh.active_ = true;
+    }
+    vector<RangeHash> pieces, computed;
+    Status st;
+    const leveldb::Snapshot* snap = db->getdb()->GetSnapshot();
+    for (auto& s: segs) {
+        if (s.leaf) {
+            pieces.push_back(s);
+            continue;
+        }
+        size_t n = pieces.size();
+        st = computePieces(db, snap, s.begin, s.end, rh.pieceSize_, &pieces);
+        if (!st.ok()) {
+            break;
+        }
+        computed.insert(computed.end(), pieces.begin() + n, pieces.end());
+    }
+    db->getdb()->ReleaseSnapshot(snap);
+    {
+        lock_guard<mutex> lk(rh.mu_);
+        for (auto& p: computed) {
+            bool stale = rh.overflow_;
+            for (size_t i = 0; !stale && i < rh.written_.size(); i ++) {
+                stale = rh.written_[i] >= p.begin && rh.written_[i] < p.end;
+            }
+            auto it = rh.pieces_.lower_bound(p.begin);
+            stale = stale || (it != rh.pieces_.end() && it->first < p.end)
+                || (it != rh.pieces_.begin() && prev(it)->second.end > p.begin);
+            if (!stale) {
+                rh.pieces_[p.begin] = p;
+            }
+        }
+        if (--rh.computing_ == 0) {
+            rh.written_.clear();
+            rh.overflow_ = false;
+        }
+        rh.active_ = rh.pieces_.size() || rh.computing_;
+    }
+    if (!st.ok()) {
+        return st;
+    }
+    //consecutive pieces are grouped until a group has its share of bytes
+    int64_t total = 0;
+    for (auto& p: pieces) {
+        total += p.bytes;
+    }
+    parts = max(parts, 1);
+    int64_t share = total / parts;
+    for (auto& p: pieces) {
+        RangeHash* g = out->size() ? &out->back() : NULL;
+        if (g == NULL || (int)pieces.size() <= parts || (g->bytes >= share && (int)out->size() < parts)) {
+            out->push_back(p);
+            out->back().leaf = true;
+            continue;
+        }
+        g->end = p.end;
+        g->hash ^= p.hash;
+        g->count += p.count;
+        g->bytes += p.bytes;
+        g->leaf = false;
+        if (p.expireAt && (g->expireAt == 0 || p.expireAt < g->expireAt)) {
+            g->expireAt = p.expireAt;
+        }
+    }
+    return Status();
+}
+
+void encodeRangeHashes(const vector<RangeHash>& ranges, string* body) {
+    for (auto& r: ranges) {
+        string v = util::format("%016lx %ld %ld %d ", (unsigned long)r.hash, (long)r.count, (long)r.bytes, r.leaf ? 1 : 0) + r.end;
+        Slice sv(v);
+        addKvBody(r.begin, &sv, body);
+    }
+}
+
+Status decodeRangeHashes(Slice body, vector<RangeHash>* ranges) {
+    Status st;
+    Slice key, value;
+    bool exist;
+    while (body.size() && (st=decodeKvBody(&body, &key, &value, &exist), st.ok())) {
+        RangeHash r;
+        r.begin = key;
+        const char* p = value.begin();
+        int64_t fields[4];
+        for (int i = 0; i < 4; i ++) {
+            const char* pe = (const char*)memchr(p, ' ', value.end() - p);
+            if (pe == NULL) {
+                return Status::fromFormat(EINVAL, "bad range hash %.*s", (int)value.size(), value.data());
+            }
+            fields[i] = i == 0 ? (int64_t)strtoull(string(p, pe).c_str(), NULL, 16) : util::atoi(p, pe);
+            p = pe + 1;
+        }
+        r.hash = fields[0];
+        r.count = fields[1];
+        r.bytes = fields[2];
+        r.leaf = fields[3];
+        r.end = string(p, value.end());
+        ranges->push_back(r);
+    }
+    return st;
+}
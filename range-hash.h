@@ -0,0 +1,52 @@
+#pragma once
+#include <handy/handy.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+using namespace handy;
+
+struct LogDb;
+
+//hash of the live keys in [begin, end), xor of the hashes of key and value, so adjacent ranges combine
+struct RangeHash {
+    string begin, end;
+    uint64_t hash;
+    int64_t count, bytes;
+    time_t expireAt; //a key in range expires then and the hash changes, 0 for none
+    bool leaf; //a single piece, not split further
+    RangeHash(): hash(0), count(0), bytes(0), expireAt(0), leaf(true) {}
+};
+
+//hashes of computed pieces of about pieceSize bytes. a write drops the piece containing the key,
+//so only pieces changed since the last check are read again
+struct RangeHashes {
+    RangeHashes(): active_(false), pieceSize_(4*1024*1024), computing_(0), overflow_(false) {}
+    void init(int64_t pieceSize) { pieceSize_ = pieceSize; }
+    //called for every written key
+    void invalidate(Slice key) {
+        if (active_) {
+            invalidate_(key);
+        }
+    }
+    size_t size() { lock_guard<mutex> lk(mu_); return pieces_.size(); }
+
+    atomic<bool> active_; //there are pieces or a computation is running
+    int64_t pieceSize_;
+    mutex mu_;
+    map<string, RangeHash> pieces_; //by begin, not overlapping
+    int computing_;
+    vector<string> written_; //keys written while computing, pieces containing them are not cached
+    bool overflow_; //too many keys written while computing, nothing computed is cached
+
+    void invalidate_(Slice key);
+};
+
+//split [begin, end) into at most parts ranges of about equal bytes, on boundaries of cached pieces.
+//an empty end is the end of user keys
+Status hashRange(LogDb* db, const string& begin, const string& end, int parts, vector<RangeHash>* out);
+//each range as kv body, key is begin and value is 'hash count bytes leaf end'
+void encodeRangeHashes(const vector<RangeHash>& ranges, string* body);
+Status decodeRangeHashes(Slice body, vector<RangeHash>* ranges);
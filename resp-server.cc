@@ -0,0 +1,312 @@
+#include "resp-server.h"
+#include "handler.h"
+#include "async-log.h"
+#include <algorithm>
+#include <memory>
+
+typedef vector<string> RespArgs;
+
+//state of a redis connection. only one task runs for a connection at a time, so replies keep the order of commands
+struct RespState {
+    bool busy;
+    RespState(): busy(false) {}
+};
+
+static void addStatus(string* out, const char* st) {
+    out->append("+").append(st).append("\r\n");
+}
+
+static void addError(string* out, const string& msg) {
+    out->append("-ERR ").append(msg).append("\r\n");
+}
+
+static void addInt(string* out, int64_t n) {
+    out->append(util::format(":%ld\r\n", n));
+}
+
+static void addArray(string* out, int64_t n) {
+    out->append(util::format("*%ld\r\n", n));
+}
+
+static void addBulk(string* out, Slice v) {
+    out->append(util::format("$%ld\r\n", (int64_t)v.size()));
+    out->append(v.data(), v.size());
+    out->append("\r\n");
+}
+
+static void addNil(string* out) {
+    out->append("$-1\r\n");
+}
+
+//parse a command at p, returns bytes consumed, 0 if incomplete, -1 on protocol error
+static int64_t parseCommand(const char* p, const char* pe, RespArgs* args) {
+    args->clear();
+    const char* ln = (const char*)memchr(p, '\n', pe - p);
+    if (ln == NULL) {
+        return pe - p > 64*1024 ? -1 : 0;
+    }
+    if (*p != '*') { //inline command, as sent by telnet
+        const char* b = p;
+        for (const char* q = p; q <= ln; q ++) {
+            if (q == ln || *q == ' ' || *q == '\r') {
+                if (q > b) {
+                    args->push_back(string(b, q));
+                }
+                b = q + 1;
+            }
+        }
+        return ln + 1 - p;
+    }
+    int64_t n = util::atoi(p+1, ln);
+    if (n <= 0 || n > 1024*1024) {
+        return -1;
+    }
+    const char* q = ln + 1;
+    for (int64_t i = 0; i < n; i ++) {
+        if (q >= pe) {
+            return 0;
+        }
+        if (*q != '$') {
+            return -1;
+        }
+        ln = (const char*)memchr(q, '\n', pe - q);
+        if (ln == NULL) {
+            return 0;
+        }
+        int64_t len = util::atoi(q+1, ln);
+        if (len < 0 || len > 512*1024*1024) {
+            return -1;
+        }
+        q = ln + 1;
+        if (pe - q < len + 2) {
+            return 0;
+        }
+        args->push_back(string(q, len));
+        q += len + 2;
+    }
+    return q - p;
+}
+
+static bool isWrite(const string& cmd) {
+    return cmd == "SET" || cmd == "DEL" || cmd == "MSET" || cmd == "INCR" || cmd == "INCRBY";
+}
+
+static void addStatusReply(string* out, Status st) {
+    if (st.ok()) {
+        addStatus(out, "OK");
+    } else {
+        addError(out, st.msg());
+    }
+}
+
+static void execScan(LogDb* db, RespArgs& args, string* out) {
+    //cursor is "0" at begin and end, otherwise '1' followed by the key to continue from
+    Slice cursor = args[1];
+    int64_t count = 10;
+    for (size_t i = 2; i + 1 < args.size(); i += 2) {
+        string opt = args[i];
+        transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+        if (opt == "COUNT") {
+            count = max(util::atoi(args[i+1].c_str()), (int64_t)1);
+        }
+    }
+    count = min(count, (int64_t)g_batch_count);
+    unique_ptr<leveldb::Iterator> it(db->getdb()->NewIterator(leveldb::ReadOptions()));
+    if (cursor == "0") {
+        it->SeekToFirst();
+    } else {
+        it->Seek(convSlice(cursor.sub(1)));
+    }
+    string keysData;
+    vector<size_t> lens;
+    Slice v;
+    for (; it->Valid() && (int64_t)lens.size() < count; it->Next()) {
+        Slice k = convSlice(it->key());
+        if (isMetaKey(k)) {
+            break;
+        }
+        if (LogDb::decodeValue(convSlice(it->value()), &v)) {
+            keysData.append(k.data(), k.size());
+            lens.push_back(k.size());
+        }
+    }
+    addArray(out, 2);
+    if (it->Valid() && !isMetaKey(convSlice(it->key()))) {
+        addBulk(out, "1" + it->key().ToString());
+    } else {
+        addBulk(out, "0");
+    }
+    addArray(out, lens.size());
+    const char* p = keysData.data();
+    for (size_t l: lens) {
+        addBulk(out, Slice(p, l));
+        p += l;
+    }
+}
+
+static void execCommand(LogDb* db, RespArgs& args, string* out) {
+    const string& cmd = args[0]; //upper cased when parsed
+    string value;
+    Status st;
+    size_t argc = args.size();
+    bool badArgs = false;
+    if (isWrite(cmd)) {
+        for (size_t i = 1; i < argc; i += (cmd == "MSET" ? 2 : 1)) {
+            if (isMetaKey(args[i])) {
+                addError(out, "reserved key");
+                return;
+            }
+            if (cmd != "DEL" && cmd != "MSET") {
+                break;
+            }
+        }
+    }
+    if (cmd == "PING") {
+        addStatus(out, "PONG");
+    } else if (cmd == "GET") {
+        if (!(badArgs = argc != 2)) {
+            st = db->get(leveldb::ReadOptions(), args[1], &value);
+            if (st.ok()) {
+                db->hotKeys_.onRead(args[1], args[1].size() + value.size());
+                addBulk(out, value);
+            } else if (st.code() == ENOENT) {
+                addNil(out);
+            } else {
+                addError(out, st.msg());
+            }
+        }
+    } else if (cmd == "SET") {
+        time_t expire = 0;
+        bool badExpire = false;
+        if (argc == 5) {
+            string opt = args[3];
+            transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+            Slice n = args[4];
+            //seconds should be a positive integer of at most 9 digits, an expired key would be written to binlog as well
+            badExpire = n.empty() || n.size() > 9 || find_if(n.begin(), n.end(), [](char c) { return !isdigit(c); }) != n.end()
+                || util::atoi(args[4].c_str()) <= 0;
+            expire = opt == "EX" ? time(NULL) + util::atoi(args[4].c_str()) : -1;
+        }
+        badArgs = (argc != 3 && argc != 5) || expire < 0;
+        if (!badArgs && badExpire) {
+            addError(out, "invalid expire time in 'set' command");
+        } else if (!badArgs) {
+            addStatusReply(out, db->write(args[1], args[2], expire));
+        }
+    } else if (cmd == "DEL") {
+        if (!(badArgs = argc < 2)) {
+            int64_t n = 0;
+            for (size_t i = 1; st.ok() && i < argc; i ++) {
+                st = db->get(leveldb::ReadOptions(), args[i], &value);
+                if (st.ok()) {
+                    n ++;
+                    st = db->remove(args[i]);
+                } else if (st.code() == ENOENT) {
+                    st = Status();
+                }
+            }
+            st.ok() ? addInt(out, n) : addError(out, st.msg());
+        }
+    } else if (cmd == "MGET") {
+        if (!(badArgs = argc < 2)) {
+            addArray(out, argc - 1);
+            for (size_t i = 1; i < argc; i ++) {
+                st = db->get(leveldb::ReadOptions(), args[i], &value);
+                if (st.ok()) {
+                    db->hotKeys_.onRead(args[i], args[i].size() + value.size());
+                    addBulk(out, value);
+                } else {
+                    addNil(out);
+                }
+            }
+        }
+    } else if (cmd == "MSET") {
+        if (!(badArgs = argc < 3 || argc % 2 == 0)) {
+            for (size_t i = 1; st.ok() && i < argc; i += 2) {
+                st = db->write(args[i], args[i+1]);
+            }
+            addStatusReply(out, st);
+        }
+    } else if (cmd == "INCR" || cmd == "INCRBY") {
+        if (!(badArgs = argc != (cmd == "INCR" ? 2 : 3))) {
+            int64_t result = 0;
+            st = db->incr(args[1], argc == 3 ? util::atoi(args[2].c_str()) : 1, -1, &result);
+            st.ok() ? addInt(out, result) : addError(out, st.msg());
+        }
+    } else if (cmd == "SCAN") {
+        if (!(badArgs = argc < 2)) {
+            execScan(db, args, out);
+        }
+    } else if (cmd == "COMMAND") { //sent by redis-cli on connect
+        addArray(out, 0);
+    } else {
+        addError(out, "unknown command '" + args[0] + "'");
+    }
+    if (badArgs) {
+        addError(out, "wrong number of arguments for '" + args[0] + "' command");
+    }
+}
+
+static void processRespInput(EventBase& base, LogDb* db, const TcpConnPtr& con, ThreadPool& rpool, ThreadPool& wpool) {
+    RespState& rs = con->context<RespState>();
+    Buffer& input = con->getInput();
+    if (rs.busy || input.empty()) {
+        return;
+    }
+    shared_ptr<vector<RespArgs>> cmds(new vector<RespArgs>);
+    bool write = false;
+    const char* p = input.begin();
+    while (p < input.end() && cmds->size() < (size_t)g_batch_count) {
+        RespArgs args;
+        int64_t r = parseCommand(p, input.end(), &args);
+        if (r < 0) {
+            error("bad redis protocol from %s, closing", con->str().c_str());
+            con->send("-ERR protocol error\r\n");
+            con->close();
+            return;
+        } else if (r == 0) {
+            break;
+        }
+        p += r;
+        if (args.size()) {
+            transform(args[0].begin(), args[0].end(), args[0].begin(), ::toupper);
+            write = write || isWrite(args[0]);
+            cmds->push_back(move(args));
+        }
+    }
+    input.consume(p - input.begin());
+    if (cmds->empty()) {
+        return;
+    }
+    rs.busy = true;
+    auto reply = [=, &base, &rpool, &wpool](shared_ptr<string> out) {
+        base.safeCall([=, &base, &rpool, &wpool] {
+            if (con->getState() != TcpConn::Connected) {
+                return;
+            }
+            con->send(*out);
+            con->context<RespState>().busy = false;
+            processRespInput(base, db, con, rpool, wpool);
+        });
+    };
+    addReqTask(&base, write ? wpool : rpool, db, write, [=] {
+        shared_ptr<string> out(new string);
+        for (auto& args: *cmds) {
+            execCommand(db, args, out.get());
+        }
+        adebug("redis %ld commands processed reply length %ld", (long)cmds->size(), (long)out->size());
+        reply(out);
+    }, [=](const char* reason) {
+        shared_ptr<string> out(new string);
+        for (size_t i = 0; i < cmds->size(); i ++) {
+            out->append("-BUSY ").append(reason).append("\r\n");
+        }
+        reply(out);
+    });
+}
+
+void setupRespServer(TcpServer& svr, EventBase& base, LogDb* db, ThreadPool& rpool, ThreadPool& wpool) {
+    svr.onConnRead([&base, db, &rpool, &wpool](const TcpConnPtr& con) {
+        processRespInput(base, db, con, rpool, wpool);
+    });
+}
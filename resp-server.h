@@ -0,0 +1,12 @@
+#pragma once
+#include <handy/handy.h>
+#include <handy/threads.h>
+#include "logdb.h"
+
+using namespace std;
+using namespace handy;
+
+//redis protocol front end, for small requests that do not want the cost of http.
+//GET SET DEL MGET MSET SCAN INCR INCRBY PING are mapped onto the same LogDb operations as http.
+//commands pipelined by a client are executed in order by one task, in write pool if any of them writes
+void setupRespServer(TcpServer& svr, EventBase& base, LogDb* db, ThreadPool& rpool, ThreadPool& wpool);
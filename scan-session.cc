@@ -0,0 +1,85 @@
+#include "scan-session.h"
+
+ScanSession::ScanSession(leveldb::DB* db1): db(db1), expire(0) {
+    snapshot = db->GetSnapshot();
+    leveldb::ReadOptions options;
+    options.snapshot = snapshot;
+    options.fill_cache = false; //a long scan should not evict the working set
+    it = db->NewIterator(options);
+}
+
+ScanSession::~ScanSession() {
+    delete it;
+    db->ReleaseSnapshot(snapshot);
+}
+
+ScanSession* ScanSessions::create(leveldb::DB* db) {
+    {
+        lock_guard<mutex> lk(*this);
+        if ((int64_t)sessions_.size() + taken_ >= maxSessions_) {
+            return NULL;
+        }
+        taken_ ++;
+    }
+    return new ScanSession(db);
+}
+
+ScanSession* ScanSessions::take(const string& token) {
+    lock_guard<mutex> lk(*this);
+    auto p = sessions_.find(token);
+    if (p == sessions_.end()) {
+        return NULL;
+    }
+    ScanSession* ss = p->second;
+    sessions_.erase(p);
+    taken_ ++;
+    return ss;
+}
+
+string ScanSessions::put(ScanSession* ss, const string& token) {
+    lock_guard<mutex> lk(*this);
+    string tk = token;
+    if (tk.empty()) {
+        tk = util::format("%lx%lx", (long)++seq_, (long)util::timeMicro());
+    }
+    ss->expire = util::timeMilli() + ttl_ * 1000;
+    sessions_[tk] = ss;
+    taken_ --;
+    return tk;
+}
+
+void ScanSessions::release(ScanSession* ss) {
+    delete ss;
+    lock_guard<mutex> lk(*this);
+    taken_ --;
+}
+
+void ScanSessions::expire() {
+    vector<ScanSession*> expired;
+    {
+        lock_guard<mutex> lk(*this);
+        int64_t now = util::timeMilli();
+        for (auto p = sessions_.begin(); p != sessions_.end(); ) {
+            if (p->second->expire < now) {
+                expired.push_back(p->second);
+                p = sessions_.erase(p);
+            } else {
+                ++p;
+            }
+        }
+    }
+    for (auto ss: expired) {
+        delete ss;
+    }
+    if (expired.size()) {
+        info("%ld scan sessions expired", (long)expired.size());
+    }
+}
+
+void ScanSessions::clear() {
+    lock_guard<mutex> lk(*this);
+    for (auto& p: sessions_) {
+        delete p.second;
+    }
+    sessions_.clear();
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <handy/handy.h>
+#include <map>
+#include "leveldb/db.h"
+
+using namespace std;
+using namespace handy;
+
+//a paged scan pinned to one snapshot. pages resume the iterator where the last page stopped
+struct ScanSession {
+    leveldb::DB* db;
+    const leveldb::Snapshot* snapshot;
+    leveldb::Iterator* it;
+    string ekey;
+    int64_t expire; //ms
+    ScanSession(leveldb::DB* db1);
+    ~ScanSession();
+};
+
+struct ScanSessions: public mutex {
+    ScanSessions(): maxSessions_(0), ttl_(0), seq_(0), taken_(0) {}
+    ~ScanSessions() { clear(); }
+    void init(int maxSessions, int ttlSeconds) { maxSessions_ = maxSessions; ttl_ = ttlSeconds; }
+    //NULL if too many sessions are open
+    ScanSession* create(leveldb::DB* db);
+    //take the session out while a page is served, NULL if token is expired or in use
+    ScanSession* take(const string& token);
+    //give the session back for the next page, returns its token
+    string put(ScanSession* ss, const string& token);
+    void release(ScanSession* ss);
+    void expire();
+    void clear();
+    int64_t size() { lock_guard<mutex> lk(*this); return sessions_.size() + taken_; }
+
+    int maxSessions_;
+    int ttl_;
+    int64_t seq_;
+    int64_t taken_; //sessions out serving pages
+    map<string, ScanSession*> sessions_;
+};
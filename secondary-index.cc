@@ -0,0 +1,149 @@
+#include "secondary-index.h"
+#include "globals.h"
+
+//string or scalar value of a top level field of a JSON object, strings are returned without unescaping
+static bool jsonField(Slice json, const string& field, string* out) {
+    const char* p = json.begin();
+    const char* pe = json.end();
+    int depth = 0;
+    bool wantKey = false;
+    while (p < pe) {
+        char c = *p;
+        if (c == '{' || c == '[') {
+            depth ++;
+            wantKey = c == '{' && depth == 1;
+            p ++;
+        } else if (c == '}' || c == ']') {
+            depth --;
+            p ++;
+        } else if (c == ',') {
+            wantKey = depth == 1;
+            p ++;
+        } else if (c == '"') {
+            const char* b = ++p;
+            while (p < pe && *p != '"') {
+                p += *p == '\\' ? 2 : 1;
+            }
+            if (p >= pe) {
+                return false;
+            }
+            Slice s(b, p++);
+            if (!wantKey) {
+                continue;
+            }
+            wantKey = false;
+            while (p < pe && (isspace(*p) || *p == ':')) {
+                p ++;
+            }
+            if (s != field || p >= pe) {
+                continue;
+            }
+            if (*p == '"') {
+                b = ++p;
+                while (p < pe && *p != '"') {
+                    p += *p == '\\' ? 2 : 1;
+                }
+                if (p >= pe) {
+                    return false;
+                }
+                out->assign(b, p);
+                return true;
+            } else if (*p == '{' || *p == '[') { //only scalars are indexed
+                return false;
+            }
+            b = p;
+            while (p < pe && *p != ',' && *p != '}' && !isspace(*p)) {
+                p ++;
+            }
+            out->assign(b, p);
+            return out->size() && *out != "null";
+        } else {
+            p ++;
+        }
+    }
+    return false;
+}
+
+bool IndexDef::term(Slice key, Slice value, string* t) const {
+    if (!key.starts_with(prefix)) {
+        return false;
+    }
+    if (part < 0) {
+        return jsonField(value, field, t);
+    }
+    vector<Slice> parts = key.split(delimiter);
+    if ((size_t)part >= parts.size()) {
+        return false;
+    }
+    *t = parts[part].toString();
+    return true;
+}
+
+bool IndexDef::decodeEntry(Slice entry, Slice* term, Slice* key) const {
+    string pre = entryPrefix();
+    if (!entry.starts_with(pre)) {
+        return false;
+    }
+    Slice rest(entry.begin() + pre.size(), entry.end());
+    const char* z = (const char*)memchr(rest.data(), '\0', rest.size());
+    if (z == NULL) {
+        return false;
+    }
+    *term = Slice(rest.begin(), z);
+    *key = Slice(z + 1, rest.end());
+    return true;
+}
+
+Status SecondaryIndexes::init(Conf& conf) {
+    for (auto& item: Slice(conf.get("", "indexes", "")).split(',')) {
+        Slice it = item.trimSpace();
+        if (it.empty()) {
+            continue;
+        }
+        IndexDef def;
+        def.name = it;
+        string sec = "index." + def.name;
+        def.prefix = conf.get(sec, "prefix", "");
+        def.field = conf.get(sec, "field", "");
+        def.part = conf.getInteger(sec, "key_part", -1);
+        string delim = conf.get(sec, "key_delimiter", ":");
+        def.delimiter = delim.size() ? delim[0] : ':';
+        if (def.name.find('\0') != string::npos || find(def.name) || (def.part < 0 && def.field.empty())) {
+            return Status::fromFormat(EINVAL, "bad index %s, field or key_part should be set in section %s", def.name.c_str(), sec.c_str());
+        }
+        defs.push_back(def);
+    }
+    return Status();
+}
+
+bool SecondaryIndexes::covers(Slice key) const {
+    for (auto& d: defs) {
+        if (key.starts_with(d.prefix)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+const IndexDef* SecondaryIndexes::find(Slice name) const {
+    for (auto& d: defs) {
+        if (name == d.name) {
+            return &d;
+        }
+    }
+    return NULL;
+}
+
+void SecondaryIndexes::stage(Slice key, const Slice* old, const Slice* value, leveldb::WriteBatch* batch) const {
+    string ot, nt;
+    for (auto& d: defs) {
+        bool o = old && d.term(key, *old, &ot);
+        bool n = value && d.term(key, *value, &nt);
+        if (o && (!n || ot != nt)) {
+            batch->Delete(d.entryKey(ot, key));
+        }
+        if (n && (!o || ot != nt)) {
+            batch->Put(d.entryKey(nt, key), "");
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <handy/handy.h>
+#include <handy/conf.h>
+#include <handy/status.h>
+#include <atomic>
+#include "leveldb/write_batch.h"
+#include "value-meta.h"
+
+using namespace std;
+using namespace handy;
+
+//secondary index over keys beginning with prefix. the term of a key is a top level field of its JSON value,
+//or a part of the key split by delimiter. entries are meta keys '\xff\xffi' name '\0' term '\0' key with empty value
+struct IndexDef {
+    string name, prefix, field;
+    char delimiter;
+    int part; //index of the key part used as term, -1 to use field
+    IndexDef(): delimiter(':'), part(-1) {}
+    //false if the key or value has no term
+    bool term(Slice key, Slice value, string* t) const;
+    //entries of this index begin with it
+    string entryPrefix() const { return string(META_KEY_PREFIX) + "i" + name + '\0'; }
+    string entryKey(Slice term, Slice key) const { return entryPrefix() + term.toString() + '\0' + key.toString(); }
+    //term and key of an entry of this index
+    bool decodeEntry(Slice entry, Slice* term, Slice* key) const;
+};
+
+//indexes configured as 'indexes = email,city', options of each in section index.<name> of leveldbd.conf.
+//entries are staged in the write batch of the primary write, so they are written atomically with it.
+//an entry may be left behind by writes of one key in one batch, readers check the term against the value
+struct SecondaryIndexes {
+    vector<IndexDef> defs;
+    atomic<int64_t> stale_; //entries skipped by readers as their key no longer has the term
+    SecondaryIndexes(): stale_(0) {}
+    Status init(Conf& conf);
+    bool empty() { return defs.empty(); }
+    bool covers(Slice key) const;
+    const IndexDef* find(Slice name) const;
+    //stage entry changes of key when its value changes from old to value, NULL for none
+    void stage(Slice key, const Slice* old, const Slice* value, leveldb::WriteBatch* batch) const;
+};
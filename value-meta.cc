@@ -0,0 +1,69 @@
+#include "value-meta.h"
+#include <handy/logging.h>
+#include <string.h>
+
+static size_t metaLen(int flags) {
+    return META_MAGIC_LEN + 1 + ((flags & ValueMeta::HasVersion) ? 8 + 4 : 0)
+        + ((flags & ValueMeta::HasExpire) ? 8 : 0) + ((flags & ValueMeta::HasBlob) ? 24 : 0);
+}
+
+Slice ValueMeta::encode(Slice value, string* scratch) const {
+    if (flags == 0 && !value.starts_with(Slice(META_MAGIC, META_MAGIC_LEN))) {
+        return value;
+    }
+    size_t hl = metaLen(flags);
+    scratch->resize(hl + value.size());
+    char* p = &(*scratch)[0];
+    memcpy(p, META_MAGIC, META_MAGIC_LEN);
+    p += META_MAGIC_LEN;
+    *p++ = (char)flags;
+    if (flags & HasVersion) {
+        memcpy(p, &ts, 8);
+        memcpy(p+8, &dbid, 4);
+        p += 12;
+    }
+    if (flags & HasExpire) {
+        memcpy(p, &expire, 8);
+        p += 8;
+    }
+    if (flags & HasBlob) {
+        memcpy(p, &blobFile, 8);
+        memcpy(p+8, &blobOffset, 8);
+        memcpy(p+16, &blobSize, 8);
+        p += 24;
+    }
+    memcpy(p, value.data(), value.size());
+    return *scratch;
+}
+
+bool ValueMeta::decode(Slice stored, ValueMeta* meta, Slice* value) {
+    *meta = ValueMeta();
+    *value = stored;
+    if (!stored.starts_with(Slice(META_MAGIC, META_MAGIC_LEN)) || stored.size() < META_MAGIC_LEN + 1) {
+        return true;
+    }
+    const char* p = stored.data() + META_MAGIC_LEN;
+    int flags = (unsigned char)*p++;
+    size_t hl = metaLen(flags);
+    if (stored.size() < hl) {
+        error("bad value meta flags %d len %ld", flags, (long)stored.size());
+        return true;
+    }
+    meta->flags = flags;
+    if (flags & HasVersion) {
+        memcpy(&meta->ts, p, 8);
+        memcpy(&meta->dbid, p+8, 4);
+        p += 12;
+    }
+    if (flags & HasExpire) {
+        memcpy(&meta->expire, p, 8);
+        p += 8;
+    }
+    if (flags & HasBlob) {
+        memcpy(&meta->blobFile, p, 8);
+        memcpy(&meta->blobOffset, p+8, 8);
+        memcpy(&meta->blobSize, p+16, 8);
+    }
+    *value = Slice(stored.data() + hl, stored.end());
+    return !meta->deleted();
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <handy/slice.h>
+#include <handy/util.h>
+#include <string>
+#include <time.h>
+
+using namespace std;
+using namespace handy;
+
+const char META_MAGIC[] = "\xff\xfemd";
+const size_t META_MAGIC_LEN = 4;
+
+//keys with this prefix hold server side indexes, clients can not see or write them
+const char META_KEY_PREFIX[] = "\xff\xff";
+inline bool isMetaKey(Slice key) { return key.starts_with(META_KEY_PREFIX); }
+
+//values carrying server side metadata are stored as
+// magic flags [ts dbid] [expire] [blobfile bloboffset blobsize] value
+// 4     1     8  4     8        8        8          8
+//value is empty when it is kept in a blob file
+//other values are stored as is, unless they begin with magic, then they are stored with flags 0
+struct ValueMeta {
+    enum { HasVersion=1, Deleted=2, HasExpire=4, HasBlob=8, };
+    int flags;
+    int64_t ts; //hybrid timestamp, physical milliseconds << 16 | logical counter
+    int32_t dbid;
+    int64_t expire; //unix time the key expires
+    int64_t blobFile, blobOffset, blobSize;
+    ValueMeta(): flags(0), ts(0), dbid(0), expire(0), blobFile(0), blobOffset(0), blobSize(0) {}
+    ValueMeta(int64_t ts1, int32_t dbid1, bool deleted): flags(HasVersion|(deleted?Deleted:0)), ts(ts1), dbid(dbid1), expire(0),
+        blobFile(0), blobOffset(0), blobSize(0) {}
+
+    bool hasVersion() const { return flags & HasVersion; }
+    bool deleted() const { return flags & Deleted; }
+    bool hasExpire() const { return flags & HasExpire; }
+    bool hasBlob() const { return flags & HasBlob; }
+    bool expired(time_t now) const { return hasExpire() && expire <= now; }
+    void setExpire(int64_t tm) { flags |= HasExpire; expire = tm; }
+    void setBlob(int64_t file, int64_t offset, int64_t size) { flags |= HasBlob; blobFile = file; blobOffset = offset; blobSize = size; }
+    //last writer wins, ties broken by dbid so every node picks the same one
+    bool olderThan(const ValueMeta& m) const { return ts < m.ts || (ts == m.ts && dbid < m.dbid); }
+    static int64_t tsFromTime(time_t tm) { return ((int64_t)tm * 1000) << 16; }
+    static time_t timeFromTs(int64_t ts) { return (ts >> 16) / 1000; }
+
+    //returns the bytes to store for value, either value itself or data filled in scratch
+    Slice encode(Slice value, string* scratch) const;
+    //false if stored is a tombstone. corrupted meta is returned as plain value
+    static bool decode(Slice stored, ValueMeta* meta, Slice* value);
+};
+
+//hybrid logical clock. now() is strictly increasing and larger than every ts passed to update()
+//used only in the write thread
+struct HybridClock {
+    int64_t last;
+    HybridClock(): last(0) {}
+    int64_t now() { last = max(last + 1, util::timeMilli() << 16); return last; }
+    void update(int64_t ts) { last = max(last, ts); }
+};
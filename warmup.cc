@@ -0,0 +1,96 @@
+#include "warmup.h"
+#include <handy/file.h>
+#include <handy/logging.h>
+#include <algorithm>
+#include <chrono>
+
+void Warmup::init(Conf& conf, const string& dbdir) {
+    capacity_ = max(0L, conf.getInteger("", "warm_keys", 65536));
+    rate_ = max(1L, conf.getInteger("", "warm_rate", 5000));
+    file_ = dbdir + "warm-keys";
+}
+
+void Warmup::add(Slice key) {
+    lock_guard<mutex> lk(mu_);
+    seen_ ++;
+    if (keys_.size() < capacity_) {
+        keys_.push_back(key);
+        return;
+    }
+    //keeps each key offered with the same chance, capacity_/seen_
+    static thread_local uint64_t x = 88172645463325252ULL;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    uint64_t r = x % seen_;
+    if (r < capacity_) {
+        keys_[r] = key;
+    }
+}
+
+Status Warmup::save() {
+    vector<string> keys;
+    {
+        lock_guard<mutex> lk(mu_);
+        if (keys_.empty()) { //keep the last saved set when nothing is read
+            return Status();
+        }
+        //the sample is kept, so a save soon after this one still has all of it.
+        //halving the count lets keys read from now on replace the old ones faster
+        keys = keys_;
+        seen_ = max(seen_ / 2, (int64_t)keys_.size());
+    }
+    sort(keys.begin(), keys.end());
+    keys.erase(unique(keys.begin(), keys.end()), keys.end());
+    string cont;
+    for (auto& k: keys) {
+        uint32_t len = k.size();
+        cont.append((const char*)&len, sizeof len);
+        cont.append(k);
+    }
+    Status st = file::renameSave(file_, file_+".tmp", cont);
+    info("warm keys saved %ld keys %s", (long)keys.size(), st.toString().c_str());
+    return st;
+}
+
+void Warmup::start(leveldb::DB* db) {
+    string cont;
+    Status st = file::getContent(file_, cont);
+    if (!st.ok()) {
+        info("no warm keys loaded %s", st.toString().c_str());
+        return;
+    }
+    running_ = true;
+    thread_ = thread([this, db, cont] {
+        vector<Slice> keys;
+        for (const char* p = cont.data(); p + 4 <= cont.data() + cont.size(); ) {
+            uint32_t len = *(uint32_t*)p;
+            if (p + 4 + len > cont.data() + cont.size()) {
+                break;
+            }
+            keys.push_back(Slice(p + 4, len));
+            p += 4 + len;
+        }
+        total_ = keys.size();
+        info("warm up %ld keys at %d keys/s", (long)keys.size(), rate_);
+        int64_t start = util::timeMilli();
+        string value;
+        for (size_t i = 0; i < keys.size() && !exit_; i ++) {
+            db->Get(leveldb::ReadOptions(), leveldb::Slice(keys[i].data(), keys[i].size()), &value);
+            done_ ++;
+            int64_t ahead = (int64_t)(i + 1) * 1000 / rate_ - (util::timeMilli() - start);
+            if (ahead > 0) {
+                this_thread::sleep_for(chrono::milliseconds(ahead));
+            }
+        }
+        info("warm up done %ld of %ld keys in %ld ms", (long)done_.load(), (long)total_.load(), (long)(util::timeMilli() - start));
+        running_ = false;
+    });
+}
+
+void Warmup::exit() {
+    exit_ = true;
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <handy/handy.h>
+#include <handy/conf.h>
+#include <handy/status.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "leveldb/db.h"
+
+using namespace std;
+using namespace handy;
+
+//sample of keys read recently, saved in dbdir so a restarted server reads them back into the block cache.
+//keys are read in order at a limited rate while the server takes traffic, neighbours share the blocks loaded
+struct Warmup {
+    Warmup(): capacity_(0), rate_(0), seen_(0), total_(0), done_(0), running_(false), exit_(false) {}
+    void init(Conf& conf, const string& dbdir);
+    bool enabled() { return capacity_ > 0; }
+    //sampled read key, kept by reservoir sampling. reads before each save count half as much as the ones after it
+    void add(Slice key);
+    size_t size() { lock_guard<mutex> lk(mu_); return keys_.size(); }
+    //write the sampled keys in order to the warm file, called in the write thread by a timer and before restart
+    Status save();
+    //read the keys of the warm file in a background thread
+    void start(leveldb::DB* db);
+    void exit();
+
+    mutex mu_;
+    vector<string> keys_;
+    size_t capacity_;
+    int rate_; //keys read per second by start
+    int64_t seen_; //keys offered, halved at each save
+    string file_;
+    atomic<int64_t> total_, done_;
+    atomic<bool> running_, exit_;
+    thread thread_;
+};